@@ -0,0 +1,321 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <functional>
+
+#include "observation.h"
+
+using namespace std;
+
+
+// Microbenchmarks for the planner's kernels, one at a time, on synthetic
+// slides. Build and run with ./bench.sh; arguments are substrings of
+// kernel names to run (default all).
+
+
+// Every allocation in the process is counted; benchmarks report how many
+// happen per call of the kernel. Not inlined, or the compiler pairs the
+// malloc() in one with the delete of the other and warns.
+atomic<long long> num_allocs(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    num_allocs.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr)
+        throw bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+
+// The planner only talks to Research from runSim(), which no benchmark
+// calls.
+class Research {
+public:
+    static int addMed(int, int) { abort(); }
+    static Observation observe() { abort(); }
+    static int waitTime(int) { abort(); }
+};
+
+
+#include "solution.h"
+
+
+// Tester parameters for one synthetic slide.
+struct Config {
+    int w, h;
+    int kill_time;
+    int med_strength;
+    double spread_prob;
+};
+
+ostream &operator<<(ostream &out, const Config &c) {
+    ostringstream s;
+    s << c.w << "x" << c.h << " kt=" << c.kill_time
+      << " ms=" << c.med_strength << " sp=" << c.spread_prob;
+    return out << left << setw(28) << s.str().c_str() << right;
+}
+
+// Corners and middle of the tester's ranges: sides 15-100, kill_time
+// 1-10, med_strength 10-100, spread_prob 0.25-1.
+const vector<Config> configs = {
+    {15, 15, 1, 10, 0.25},
+    {15, 15, 10, 100, 1.0},
+    {50, 50, 3, 50, 0.5},
+    {100, 40, 2, 100, 0.75},
+    {100, 100, 1, 100, 0.25},
+    {100, 100, 10, 10, 1.0},
+};
+
+
+// Everything a kernel sees halfway through a game: a slide seeded like
+// the tester's, a few drops diffused for a while, and the model a couple
+// of spreads in.
+struct Scene {
+    Config config;
+    MedField med;
+    DropField drop_med;  // the same medicine as med
+    Model model;
+    vector<bool> phases;
+    int time_to_observation;
+
+    explicit Scene(const Config &c)
+        : config(c), med(c.w, c.h), drop_med(c.w, c.h), model(c.w, c.h) {
+        ::w = c.w;
+        ::h = c.h;
+        ::med_strength = c.med_strength;
+        ::kill_time = c.kill_time;
+        ::spread_prob = c.spread_prob;
+        ::horizon = parameters.at("horizon");
+        ::footprint_kernel = make_footprint_kernel(
+            horizon, c.w, c.h, c.med_strength);
+
+        mt19937 rng(c.w * 1000003 + c.h * 1009 + c.kill_time);
+        Observation obs(c.w, c.h);
+        int num_dead = rng() % (c.w * c.h / 10);
+        int num_infected = c.kill_time + rng() % (c.w * c.h / 10);
+        for (int i = 0; i < c.w * c.h && (num_dead > 0 || num_infected > 0); i++) {
+            int x = rng() % c.w;
+            int y = rng() % c.h;
+            if (obs.is_infected(x, y) || obs.is_dead(x, y))
+                continue;
+            if (num_dead > 0) {
+                obs.set(x, y, 'X');
+                num_dead--;
+            } else {
+                obs.set(x, y, 'V');
+                num_infected--;
+            }
+        }
+        model = slide_to_model(obs);
+
+        MedField next(c.w, c.h);
+        for (int t = 0; t < 6; t++) {
+            if (t % 2 == 0) {
+                int x = rng() % c.w;
+                int y = rng() % c.h;
+                med.at(x, y) += c.med_strength;
+                drop_med.add(x, y);
+            }
+            cure_model(med, model);
+            if (t % 3 == 2) {
+                Model new_model = model;
+                update_model(model, new_model);
+                swap(model, new_model);
+            }
+            diffusion_step(med, next);
+            swap(med, next);
+            drop_med.step();
+        }
+
+        // Same horizon as ViralInfection::make_plan() for the first round.
+        time_to_observation = c.kill_time == 1 ? 3 : c.kill_time;
+        int T = time_to_observation + (c.kill_time == 1 ? 3 : 5);
+        for (int i = 0; i < T; i++)
+            phases.push_back(i > 0 && (i + 1) % c.kill_time == 0);
+    }
+
+    int cells() const {
+        return config.w * config.h;
+    }
+};
+
+
+// Runs setup() then body() until body() has taken at least min_seconds
+// (and at least 3 times); only body() is timed and counted.
+void measure(const string &kernel, const Scene &scene,
+             const function<void()> &setup, const function<void()> &body,
+             double min_seconds = 0.2) {
+    double total_ns = 0;
+    long long allocs = 0;
+    int calls = 0;
+    while (calls < 3 || total_ns < min_seconds * 1e9) {
+        setup();
+        long long allocs_before = num_allocs.load();
+        auto start = chrono::steady_clock::now();
+        body();
+        auto end = chrono::steady_clock::now();
+        allocs += num_allocs.load() - allocs_before;
+        total_ns += chrono::duration<double, nano>(end - start).count();
+        calls++;
+    }
+    double ns_per_call = total_ns / calls;
+    cout << left << setw(20) << kernel.c_str() << right << scene.config
+         << fixed << setprecision(1)
+         << setw(14) << ns_per_call
+         << setw(12) << ns_per_call / scene.cells()
+         << setw(12) << (double)allocs / calls
+         << endl;
+}
+
+
+void run(const Scene &scene, const function<bool(const string &)> &selected) {
+    const int w = scene.config.w;
+    const int h = scene.config.h;
+    auto nothing = []() {};
+
+    if (selected("diffusion_step")) {
+        MedField med = scene.med, next(w, h);
+        measure("diffusion_step", scene, nothing, [&]() {
+            diffusion_step(med, next);
+        });
+    }
+
+    if (selected("update_model")) {
+        // Active tiles are rewritten from cur every time, so next stays a
+        // valid copy of cur between calls.
+        Model next = scene.model;
+        measure("update_model", scene, nothing, [&]() {
+            update_model(scene.model, next);
+        });
+    }
+
+    if (selected("cure_model")) {
+        Model model(w, h);
+        measure("cure_model", scene, [&]() {
+            model = scene.model;
+        }, [&]() {
+            cure_model(scene.med, model);
+        });
+    }
+
+    if (selected("modeller")) {
+        measure("modeller", scene, nothing, [&]() {
+            Modeller modeller(scene.med, scene.model, scene.phases);
+        });
+    }
+
+    if (selected("modeller_compact")) {
+        measure("modeller_compact", scene, nothing, [&]() {
+            Modeller modeller(scene.med, scene.model, scene.phases,
+                              1, nullptr, 0, true);
+        });
+    }
+
+    if (selected("modeller_drops")) {
+        measure("modeller_drops", scene, nothing, [&]() {
+            Modeller modeller(scene.drop_med, scene.model, scene.phases);
+        });
+    }
+
+    Modeller modeller(scene.med, scene.model, scene.phases);
+
+    // One call is a footprint for every drop position of the first tick.
+    if (selected("make_cure_footprint")) {
+        measure("make_cure_footprint", scene, nothing, [&]() {
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                    modeller.make_cure_footprint(x, y, 0);
+        });
+    }
+
+    if (selected("footprint_drops")) {
+        Modeller drop_modeller(scene.drop_med, scene.model, scene.phases);
+        measure("footprint_drops", scene, nothing, [&]() {
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                    drop_modeller.make_cure_footprint(x, y, 0);
+        });
+    }
+
+    bool need_frontier = selected("simulate") || selected("greedy");
+    vector<vector<CureFootprint>> frontiers(scene.time_to_observation);
+    for (int t = 0; need_frontier && t < scene.time_to_observation; t++) {
+        vector<CureFootprint> footprints;
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                auto fp = modeller.make_cure_footprint(x, y, t);
+                if (!fp.empty())
+                    footprints.push_back(move(fp));
+            }
+        frontiers[t] = pareto_frontier(footprints);
+    }
+
+    // One call simulates every frontier footprint of the first tick.
+    if (selected("simulate")) {
+        modeller.simulate({});  // sizes the scratch space
+        measure("simulate", scene, nothing, [&]() {
+            for (const auto &fp : frontiers[0])
+                modeller.simulate({fp});
+        });
+    }
+
+    if (selected("simulate_compact")) {
+        Modeller compact(scene.med, scene.model, scene.phases,
+                         1, nullptr, 0, true);
+        compact.simulate({});
+        measure("simulate_compact", scene, nothing, [&]() {
+            for (const auto &fp : frontiers[0])
+                compact.simulate({fp});
+        });
+    }
+
+    if (selected("greedy")) {
+        vector<pair<CureFootprint, Improvement>> choices;
+        for (const auto &frontier : frontiers)
+            for (const auto &fp : frontier)
+                choices.emplace_back(fp, modeller.simulate({fp}));
+        vector<pair<int, int>> sol;
+        measure("greedy", scene, [&]() {
+            sol.assign(scene.time_to_observation, {-1, -1});
+        }, [&]() {
+            greedy(choices, sol);
+        });
+    }
+}
+
+
+int main(int argc, char **argv) {
+    set_log_level(LOG_OFF);
+    parameters.at("threads") = 1;
+
+    vector<string> filters(argv + 1, argv + argc);
+    auto selected = [&](const string &kernel) {
+        if (filters.empty())
+            return true;
+        for (const auto &f : filters)
+            if (kernel.find(f) != string::npos)
+                return true;
+        return false;
+    };
+
+    cout << left << setw(20) << "kernel" << setw(28) << "config" << right
+         << setw(14) << "ns/call" << setw(12) << "ns/cell"
+         << setw(12) << "allocs/call" << endl;
+    for (const auto &c : configs) {
+        Scene scene(c);
+        run(scene, selected);
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+set -e -x
+
+# Builds the kernel microbenchmarks optimized and without sanitizers, and
+# runs them.
+# Usage: ./bench.sh [kernel ...]
+
+clang++ \
+    --std=c++0x -W -Wall -Wno-sign-compare \
+    -O3 -pipe -mmmx -msse -msse2 -msse3 \
+    -pthread \
+    $CXXFLAGS \
+    bench.cc -o bench
+
+./bench "$@"
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <thread>
+#include <chrono>
+
+
+// Leveled logging. A message is formatted on the calling thread, with the
+// usual operator<< (so pretty_printing.h applies), pushed onto a lock-free
+// ring and written to cerr by a background thread, so nothing on the
+// planning path waits for a write or flush.
+//
+// Levels below LOG_LEVEL are compiled out; the rest are filtered at run
+// time by set_log_level(). Build with -DLOG_LEVEL=LOG_TRACE to get the
+// per-step lines as well.
+#define LOG_TRACE 0
+#define LOG_DEBUG 1
+#define LOG_INFO 2
+#define LOG_OFF 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+
+// Bounded multi-producer multi-consumer queue of strings (Vyukov's
+// algorithm): each slot carries a sequence number that says whose turn it
+// is, so producers and consumers only contend on their own counter.
+class LogRing {
+public:
+    explicit LogRing(size_t capacity)
+        : mask(capacity - 1), slots(new Slot[capacity]), head(0), tail(0) {
+        assert(capacity >= 2 && (capacity & mask) == 0);
+        for (size_t i = 0; i < capacity; i++)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false if the ring is full.
+    bool push(std::string &text) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[pos & mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        slot->text.swap(text);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the ring is empty.
+    bool pop(std::string &text) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[pos & mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        text.swap(slot->text);
+        slot->text.clear();
+        slot->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Number of pushes so far.
+    size_t pushed() const {
+        return head.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        std::string text;
+    };
+
+    const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+
+// Owns the ring and the thread that drains it into cerr. When the ring is
+// full, writers yield until there is room rather than drop lines.
+class Logger {
+public:
+    Logger()
+        : ring(1 << 12), written(0), stopping(false),
+          thread(&Logger::drain_loop, this) {}
+
+    ~Logger() {
+        stopping.store(true);
+        thread.join();
+    }
+
+    void write(std::string text) {
+        while (!ring.push(text))
+            std::this_thread::yield();
+    }
+
+    // Returns once everything written so far is out of the ring and in
+    // cerr, which is flushed.
+    void flush() {
+        size_t target = ring.pushed();
+        while (written.load(std::memory_order_acquire) < target)
+            std::this_thread::yield();
+        std::cerr.flush();
+    }
+
+private:
+    void drain_loop() {
+        std::string text;
+        while (true) {
+            bool any = false;
+            while (ring.pop(text)) {
+                std::cerr.write(text.data(), text.size());
+                written.fetch_add(1, std::memory_order_release);
+                any = true;
+            }
+            if (any)
+                std::cerr.flush();
+            else if (stopping.load())
+                return;
+            else
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    LogRing ring;
+    std::atomic<size_t> written;
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+inline Logger &logger() {
+    static Logger instance;
+    return instance;
+}
+
+
+// Run-time threshold, LOG_LEVEL unless set; LOG_OFF silences everything.
+inline int &log_level() {
+    static int level = LOG_LEVEL;
+    return level;
+}
+
+inline void set_log_level(int level) {
+    assert(level >= LOG_TRACE && level <= LOG_OFF);
+    log_level() = level;
+}
+
+inline bool log_enabled(int level) {
+    return level >= LOG_LEVEL && level >= log_level();
+}
+
+// Waits until every logged line has reached cerr.
+inline void log_flush() {
+    if (log_level() < LOG_OFF)
+        logger().flush();
+}
+
+
+// LOG(LOG_DEBUG, "x = " << x) logs one line. The arguments are only
+// evaluated if the level is enabled.
+#define LOG(level, args) \
+    do { \
+        if (log_enabled(level)) { \
+            std::ostringstream log_out_; \
+            log_out_ << args << '\n'; \
+            logger().write(log_out_.str()); \
+        } \
+    } while (0)
+
+#define LOG_VARS1(x) #x " = " << (x)
+#define LOG_VARS2(x, y) LOG_VARS1(x) << ", " << LOG_VARS1(y)
+#define LOG_VARS3(x, y, z) LOG_VARS2(x, y) << ", " << LOG_VARS1(z)
+
+#define trace(x) LOG(LOG_TRACE, LOG_VARS1(x))
+#define trace2(x, y) LOG(LOG_TRACE, LOG_VARS2(x, y))
+#define trace3(x, y, z) LOG(LOG_TRACE, LOG_VARS3(x, y, z))
+
+#define debug(x) LOG(LOG_DEBUG, LOG_VARS1(x))
+#define debug2(x, y) LOG(LOG_DEBUG, LOG_VARS2(x, y))
+#define debug3(x, y, z) LOG(LOG_DEBUG, LOG_VARS3(x, y, z))
+
+// Summary lines, marked with "## " for the scripts that grep for them.
+#define info(x) LOG(LOG_INFO, "## " << LOG_VARS1(x))
+#define info2(x, y) LOG(LOG_INFO, "## " << LOG_VARS2(x, y))
+#define info3(x, y, z) LOG(LOG_INFO, "## " << LOG_VARS3(x, y, z))
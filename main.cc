@@ -3,54 +3,322 @@
 #include <string>
 #include <cassert>
 #include <sstream>
+#include <thread>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+
+#include "simulator.h"
+#include "observation.h"
+#include "sweep.h"
+#include "session.h"
 
 using namespace std;
 
 
+// Tester input; all of it goes through here, never through cin.
+InputReader input;
+
+
+// Commands are queued and sent together: flush() (and observe(), which
+// flushes first) writes everything with a single flush and only then reads
+// the replies. Consecutive waits are merged into one WAITTIME.
+//
+// Every command, reply and observation can also be written to a session
+// log (see session.h), and a log can stand in for the tester: commands are
+// then checked against the recorded ones and the recorded replies and
+// observations are returned.
 class Research {
 public:
+    // When set, calls go to the in-process simulator instead of the tester.
+    static Simulator *simulator;
+    // When set, calls are answered from this log instead.
+    static SessionReader *replay;
+    // When set, the session is recorded here.
+    static SessionWriter *record;
+    // Records answered from the replay log so far.
+    static int replayed;
+
     static int addMed(int x, int y) {
-        cout << "ADDMED" << endl;
-        cout << x << " " << y << endl;
-        cout.flush();
-        int reply;
-        cin >> reply;
-        assert(reply == 0);
-        return reply;
+        pending.emplace_back(x, y);
+        return 0;
     }
 
-    static vector<string> observe() {
-        cout << "OBSERVE" << endl;
-        cout.flush();
-        int H;
-        cin >> H;
-        vector<string> slide(H);
-        for (auto &row : slide)
-            cin >> row;
-        return slide;
+    static Observation observe() {
+        Observation obs;
+        if (simulator || replay) {
+            flush();
+            obs = simulator
+                ? Observation::from_slide(simulator->observe())
+                : replayed_observation();
+        } else {
+            string out = pending_commands();
+            out += "OBSERVE\n";
+            cout << out;
+            cout.flush();
+            read_replies();
+            obs = input.read_observation();
+        }
+        if (record)
+            record->observe(obs);
+        return obs;
     }
 
     static int waitTime(int t) {
-        cout << "WAITTIME" << endl;
-        cout << t << endl;
+        assert(t >= 1);
+        if (!pending.empty() && pending.back().first == -1)
+            pending.back().second += t;
+        else
+            pending.emplace_back(-1, t);
+        return 0;
+    }
+
+    static void flush() {
+        if (pending.empty())
+            return;
+        if (simulator || replay) {
+            for (const auto &cmd : pending) {
+                int reply;
+                if (replay)
+                    reply = replayed_reply(cmd);
+                else if (cmd.first == -1)
+                    reply = simulator->waitTime(cmd.second);
+                else
+                    reply = simulator->addMed(cmd.first, cmd.second);
+                assert(reply == 0);
+                record_command(cmd, reply);
+            }
+            pending.clear();
+            return;
+        }
+        cout << pending_commands();
         cout.flush();
-        int reply;
-        cin >> reply;
-        assert(reply == 0);
-        return reply;
+        read_replies();
+    }
+
+private:
+    // (x, y) for ADDMED, (-1, n) for WAITTIME n.
+    static vector<pair<int, int>> pending;
+
+    static string pending_commands() {
+        ostringstream out;
+        for (const auto &cmd : pending) {
+            if (cmd.first == -1)
+                out << "WAITTIME\n" << cmd.second << "\n";
+            else
+                out << "ADDMED\n" << cmd.first << " " << cmd.second << "\n";
+        }
+        return out.str();
+    }
+
+    static void read_replies() {
+        for (int i = 0; i < pending.size(); i++) {
+            int reply = input.read_int();
+            assert(reply == 0);
+            record_command(pending[i], reply);
+        }
+        pending.clear();
+    }
+
+    static void record_command(const pair<int, int> &cmd, int reply) {
+        if (!record)
+            return;
+        if (cmd.first == -1)
+            record->wait_time(cmd.second, reply);
+        else
+            record->add_med(cmd.first, cmd.second, reply);
+    }
+
+    // A planner that does something else than it did when recording gets
+    // observations that don't belong to its moves, so replay stops there.
+    static void diverged(const string &command) {
+        cerr << "replay diverged at record " << replayed << ": planner sent "
+             << command.c_str() << endl;
+        exit(1);
+    }
+
+    static int replayed_reply(const pair<int, int> &cmd) {
+        auto r = replay->next();
+        replayed++;
+        if (cmd.first == -1) {
+            if (r.tag != 'W' || r.x != cmd.second) {
+                ostringstream out;
+                out << "WAITTIME " << cmd.second;
+                diverged(out.str());
+            }
+        } else if (r.tag != 'A' || r.x != cmd.first || r.y != cmd.second) {
+            ostringstream out;
+            out << "ADDMED " << cmd.first << " " << cmd.second;
+            diverged(out.str());
+        }
+        return r.reply;
+    }
+
+    static Observation replayed_observation() {
+        auto r = replay->next();
+        replayed++;
+        if (r.tag != 'O')
+            diverged("OBSERVE");
+        return r.obs;
     }
 };
 
+Simulator *Research::simulator = nullptr;
+SessionReader *Research::replay = nullptr;
+SessionWriter *Research::record = nullptr;
+int Research::replayed = 0;
+vector<pair<int, int>> Research::pending;
+
 
 #include "solution.h"
 
 
+double run_seed(int64_t seed) {
+    Simulator sim(seed);
+    Research::simulator = &sim;
+    if (Research::record)
+        Research::record->start(
+            Observation::from_slide(sim.status()), sim.med_strength,
+            sim.kill_time, sim.spread_prob, ::parameters);
+    ViralInfection().runSim(
+        sim.status(), sim.med_strength, sim.kill_time, sim.spread_prob);
+    Research::flush();
+    Research::simulator = nullptr;
+    return sim.finish_and_score();
+}
+
+
+// Every combination of the swept values, e.g. {a: [1, 2], b: [3]} gives
+// a=1 b=3 and a=2 b=3.
+vector<SweepSetting> sweep_settings(
+        const vector<pair<string, vector<double>>> &sweep) {
+    vector<SweepSetting> settings(1);
+    for (const auto &param : sweep) {
+        vector<SweepSetting> extended;
+        for (const auto &setting : settings)
+            for (double value : param.second) {
+                extended.push_back(setting);
+                extended.back().params.emplace_back(param.first, value);
+            }
+        settings = extended;
+    }
+    return settings;
+}
+
+
+void run_sweep_and_report(
+        const vector<pair<string, vector<double>>> &sweep,
+        int64_t first_seed, int64_t last_seed, int jobs) {
+    auto settings = sweep_settings(sweep);
+    // Each child plans single-threaded unless "threads" is swept or set.
+    if (::parameters.at("threads") == 0)
+        ::parameters.at("threads") = 1;
+
+    auto start = chrono::steady_clock::now();
+    auto runs = run_sweep(settings, first_seed, last_seed, jobs,
+        [](const SweepSetting &setting, int64_t seed) {
+            for (const auto &kv : setting.params)
+                ::parameters.at(kv.first) = kv.second;
+            return run_seed(seed);
+        });
+    double wall = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+    for (int i = 0; i < settings.size(); i++) {
+        ostringstream name;
+        for (const auto &kv : settings[i].params)
+            name << kv.first.c_str() << "=" << kv.second << " ";
+        auto s = summarize_sweep(runs, i);
+        cout << name.str().c_str() << fixed << setprecision(4)
+             << "mean = " << s.mean << " +- " << s.ci95
+             << ", vs first = " << showpos << s.delta << noshowpos
+             << " +- " << s.delta_ci95
+             << ", runs = " << s.runs << ", failed = " << s.failed
+             << setprecision(2) << ", sec/seed = " << s.seconds_per_run
+             << endl;
+        cout.unsetf(ios::fixed);
+    }
+    cout << "wall = " << fixed << setprecision(1) << wall << " s, jobs = "
+         << jobs << endl;
+}
+
+
 int main(int argc, char **argv) {
+    // Native mode: "-seed N" or "-seeds FROM TO" run the in-process
+    // simulator instead of talking to the tester; "-v" keeps debug output.
+    // "-sweep PARAM V1,V2,..." (repeatable) runs the seeds for every
+    // combination of the values instead, "-jobs N" at a time (default one
+    // per core), and reports each combination's mean score.
+    // "-record FILE" logs the session (tester mode or a single seed);
+    // "-replay FILE" runs the planner on a logged session instead, with the
+    // parameters it was recorded with unless given again.
+    int64_t first_seed = -1;
+    int64_t last_seed = -1;
+    bool verbose = false;
+    vector<pair<string, vector<double>>> sweep;
+    int jobs = max<int>(thread::hardware_concurrency(), 1);
+    string record_path, replay_path;
+    vector<string> args;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-seed") {
+            assert(i + 1 < argc);
+            first_seed = last_seed = atoll(argv[++i]);
+        } else if (arg == "-seeds") {
+            assert(i + 2 < argc);
+            first_seed = atoll(argv[++i]);
+            last_seed = atoll(argv[++i]);
+        } else if (arg == "-v") {
+            verbose = true;
+        } else if (arg == "-sweep") {
+            assert(i + 2 < argc);
+            string param = argv[++i];
+            assert(::parameters.count(param) == 1);
+            vector<double> values;
+            istringstream in(argv[++i]);
+            string value;
+            while (getline(in, value, ','))
+                values.push_back(atof(value.c_str()));
+            assert(!values.empty());
+            sweep.emplace_back(param, values);
+        } else if (arg == "-record") {
+            assert(i + 1 < argc);
+            record_path = argv[++i];
+        } else if (arg == "-replay") {
+            assert(i + 1 < argc);
+            replay_path = argv[++i];
+        } else if (arg == "-jobs") {
+            assert(i + 1 < argc);
+            jobs = atoi(argv[++i]);
+            assert(jobs >= 1);
+        } else {
+            args.push_back(arg);
+        }
+    }
+    bool native = first_seed != -1 || !replay_path.empty();
+    // Sweeps fork, so the logger thread must not be started.
+    if (native && (!verbose || !sweep.empty()))
+        set_log_level(LOG_OFF);
+    assert(sweep.empty() || first_seed != -1);
+    assert(record_path.empty() || first_seed == last_seed);
+    assert(replay_path.empty() || first_seed == -1);
     debug2(argc, argv);
 
-    if (argc > 1) {
-        vector<string> args;
-        copy(argv + 1, argv + argc, back_inserter(args));
+    unique_ptr<SessionReader> replay;
+    if (!replay_path.empty()) {
+        replay.reset(new SessionReader(replay_path));
+        for (const auto &kv : replay->parameters)
+            if (::parameters.count(kv.first))
+                ::parameters.at(kv.first) = kv.second;
+            else
+                LOG(LOG_INFO, "replay: unknown parameter " << kv.first);
+    }
+    unique_ptr<SessionWriter> record;
+    if (!record_path.empty())
+        record.reset(new SessionWriter(record_path));
+    Research::record = record.get();
+
+    if (!args.empty()) {
         debug(args);
 
         for (auto p = args.begin(); p < args.end(); p += 2) {
@@ -85,26 +353,64 @@ int main(int argc, char **argv) {
                 break;
         }*/
     }
-    cerr << "done" << endl;
+    LOG(LOG_DEBUG, "done");
+
+    if (!sweep.empty()) {
+        run_sweep_and_report(sweep, first_seed, last_seed, jobs);
+        return 0;
+    }
+
+    if (replay) {
+        Research::replay = replay.get();
+        auto start = chrono::steady_clock::now();
+        ViralInfection().runSim(replay->slide.to_slide(), replay->med_strength,
+                                replay->kill_time, replay->spread_prob);
+        Research::flush();
+        double seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+        bool complete = replay->next().tag == 'E';
+        cout << "replay: records = " << Research::replayed
+             << ", complete = " << complete
+             << ", seconds = " << seconds << endl;
+        log_flush();
+        return complete ? 0 : 1;
+    }
 
-    int H;
-    cin >> H;
+    if (first_seed != -1) {
+        if (!verbose)
+            cerr.rdbuf(nullptr);
+        double total = 0.0;
+        for (int64_t seed = first_seed; seed <= last_seed; seed++) {
+            double score = run_seed(seed);
+            cout << "seed = " << seed << ", Score = " << score << endl;
+            total += score;
+        }
+        cout << "mean score = " << total / (last_seed - first_seed + 1)
+             << endl;
+        return 0;
+    }
+
+    int H = input.read_int();
     debug(H);
 
     vector<string> slide(H);
     for (auto &row : slide)
-        cin >> row;
+        row = input.read_token();
 
-    int med_strength;
-    cin >> med_strength;
-
-    int kill_time;
-    cin >> kill_time;
-
-    double spread_prob;
-    cin >> spread_prob;
+    int med_strength = input.read_int();
+    int kill_time = input.read_int();
+    double spread_prob = input.read_double();
 
+    if (record)
+        record->start(Observation::from_slide(slide), med_strength, kill_time,
+                      spread_prob, ::parameters);
     ViralInfection().runSim(slide, med_strength, kill_time, spread_prob);
+    Research::flush();
+    record.reset();
+
+    // Give the tester a chance to forward our stderr before it kills us.
+    log_flush();
+    this_thread::sleep_for(chrono::milliseconds(200));
 
     cout << "END" << endl;
     cout.flush();
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <vector>
+#include <string>
+#include <unistd.h>
+
+
+// One OBSERVE result as row-major bitmaps, plus counts. Cells are clean
+// unless their infected or dead bit is set.
+struct Observation {
+    int w, h;
+    int words_per_row;
+    std::vector<uint64_t> infected;
+    std::vector<uint64_t> dead;
+    int num_infected;
+    int num_dead;
+
+    Observation() : w(0), h(0), words_per_row(0), num_infected(0), num_dead(0) {}
+
+    Observation(int w, int h)
+        : w(w), h(h), words_per_row((w + 63) / 64),
+          infected(words_per_row * h, 0), dead(words_per_row * h, 0),
+          num_infected(0), num_dead(0) {}
+
+    static Observation from_slide(const std::vector<std::string> &slide) {
+        assert(!slide.empty());
+        Observation result(slide[0].size(), slide.size());
+        for (int y = 0; y < result.h; y++) {
+            assert(slide[y].size() == result.w);
+            for (int x = 0; x < result.w; x++)
+                result.set(x, y, slide[y][x]);
+        }
+        return result;
+    }
+
+    // Inverse of from_slide().
+    std::vector<std::string> to_slide() const {
+        std::vector<std::string> slide(h, std::string(w, 'C'));
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                if (is_infected(x, y))
+                    slide[y][x] = 'V';
+                else if (is_dead(x, y))
+                    slide[y][x] = 'X';
+        return slide;
+    }
+
+    // Recomputes the counts after the bitmaps were filled in directly.
+    void recount() {
+        num_infected = num_dead = 0;
+        for (uint64_t word : infected)
+            num_infected += __builtin_popcountll(word);
+        for (uint64_t word : dead)
+            num_dead += __builtin_popcountll(word);
+    }
+
+    bool is_infected(int x, int y) const {
+        return bit(infected, x, y);
+    }
+
+    bool is_dead(int x, int y) const {
+        return bit(dead, x, y);
+    }
+
+    // c is the tester's cell character: 'C', 'V' or 'X'.
+    void set(int x, int y, char c) {
+        assert(x >= 0 && x < w && y >= 0 && y < h);
+        uint64_t mask = 1ULL << (x % 64);
+        int i = words_per_row * y + x / 64;
+        switch (c) {
+            case 'C': break;
+            case 'V': infected[i] |= mask; num_infected++; break;
+            case 'X': dead[i] |= mask; num_dead++; break;
+            default: assert(false); break;
+        }
+    }
+
+private:
+    bool bit(const std::vector<uint64_t> &plane, int x, int y) const {
+        assert(x >= 0 && x < w && y >= 0 && y < h);
+        return plane[words_per_row * y + x / 64] >> (x % 64) & 1;
+    }
+};
+
+
+// Whitespace-separated tokens straight out of large read() chunks, so
+// that nothing goes through iostreams or per-row strings. Only one reader
+// may be used on a descriptor, and it must not be mixed with cin.
+class InputReader {
+public:
+    explicit InputReader(int fd = 0)
+        : fd(fd), buffer(1 << 16), pos(0), end(0) {}
+
+    int read_int() {
+        skip_space();
+        bool negative = peek() == '-';
+        if (negative)
+            get();
+        assert(peek() >= '0' && peek() <= '9');
+        int result = 0;
+        while (peek() >= '0' && peek() <= '9')
+            result = result * 10 + (get() - '0');
+        return negative ? -result : result;
+    }
+
+    double read_double() {
+        skip_space();
+        std::string token;
+        while (peek() != -1 && !is_space(peek()))
+            token += get();
+        char *token_end;
+        double result = strtod(token.c_str(), &token_end);
+        assert(!token.empty() && *token_end == '\0');
+        return result;
+    }
+
+    std::string read_token() {
+        skip_space();
+        std::string token;
+        while (peek() != -1 && !is_space(peek()))
+            token += get();
+        return token;
+    }
+
+    // The OBSERVE payload: height, then one token of cell characters per
+    // row. Parsed in a single pass into bitmaps.
+    Observation read_observation() {
+        int h = read_int();
+        assert(h > 0);
+        skip_space();
+        int w = 0;
+        while (peek() != -1 && !is_space(peek())) {
+            row.push_back(get());
+            w++;
+        }
+        Observation result(w, h);
+        for (int x = 0; x < w; x++)
+            result.set(x, 0, row[x]);
+        row.clear();
+        for (int y = 1; y < h; y++) {
+            skip_space();
+            for (int x = 0; x < w; x++)
+                result.set(x, y, get());
+            assert(peek() == -1 || is_space(peek()));
+        }
+        return result;
+    }
+
+private:
+    static bool is_space(int c) {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    int peek() {
+        if (pos == end && !refill())
+            return -1;
+        return buffer[pos];
+    }
+
+    char get() {
+        int c = peek();
+        assert(c != -1);
+        pos++;
+        return c;
+    }
+
+    void skip_space() {
+        while (peek() != -1 && is_space(peek()))
+            pos++;
+    }
+
+    bool refill() {
+        ssize_t n;
+        do {
+            n = read(fd, buffer.data(), buffer.size());
+        } while (n < 0 && errno == EINTR);
+        pos = 0;
+        end = n > 0 ? n : 0;
+        return end > 0;
+    }
+
+    int fd;
+    std::vector<char> buffer;
+    int pos, end;
+    std::vector<char> row;
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+// Per-round instrumentation of the planner: scoped timers and counters,
+// reported as one line of JSON. Everything here compiles to nothing unless
+// PERF_STATS is defined, e.g. CXXFLAGS=-DPERF_STATS ./sim.sh 1 10.
+//
+//   PERF_SCOPE(name)       times the enclosing scope as timer perf::name
+//   PERF_COUNT(name, n)    adds n to counter perf::name
+//   PERF_END_ROUND()       closes the current round (end of make_plan)
+//   PERF_REPORT_ON_EXIT()  clears all rounds, and when the enclosing scope
+//                          exits logs them at LOG_INFO as "## perf = {...}"
+//
+// Timers and counters may be updated from parallel_for() workers. Timers
+// called from workers add up the time of all threads, not wall time.
+
+#ifdef PERF_STATS
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+
+#include "log.h"
+
+
+namespace perf {
+
+enum Timer {
+    diffusion_build,
+    modeller_build,
+    footprint,
+    pareto,
+    simulate,
+    greedy,
+    NUM_TIMERS
+};
+
+enum Counter {
+    candidates,
+    footprints,
+    frontier,
+    choices,
+    med_cells,
+    model_cells,
+    overruns,
+    NUM_COUNTERS
+};
+
+static const char *const timer_names[NUM_TIMERS] = {
+    "diffusion_build", "modeller_build", "footprint", "pareto",
+    "simulate", "greedy",
+};
+
+static const char *const counter_names[NUM_COUNTERS] = {
+    "candidates", "footprints", "frontier", "choices", "med_cells",
+    "model_cells", "overruns",
+};
+
+struct Round {
+    long long calls[NUM_TIMERS];
+    long long ns[NUM_TIMERS];
+    long long counts[NUM_COUNTERS];
+};
+
+struct State {
+    std::atomic<long long> calls[NUM_TIMERS];
+    std::atomic<long long> ns[NUM_TIMERS];
+    std::atomic<long long> counts[NUM_COUNTERS];
+    std::vector<Round> rounds;
+
+    // Moves the current totals into a new round and zeroes them.
+    void end_round() {
+        Round r;
+        for (int i = 0; i < NUM_TIMERS; i++) {
+            r.calls[i] = calls[i].exchange(0);
+            r.ns[i] = ns[i].exchange(0);
+        }
+        for (int i = 0; i < NUM_COUNTERS; i++)
+            r.counts[i] = counts[i].exchange(0);
+        rounds.push_back(r);
+    }
+
+    void clear() {
+        end_round();
+        rounds.clear();
+    }
+};
+
+inline State &state() {
+    static State s;
+    return s;
+}
+
+inline void add(Counter c, long long n) {
+    state().counts[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+class Scope {
+public:
+    explicit Scope(Timer timer)
+        : timer(timer), start(std::chrono::steady_clock::now()) {}
+
+    ~Scope() {
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        state().calls[timer].fetch_add(1, std::memory_order_relaxed);
+        state().ns[timer].fetch_add(ns, std::memory_order_relaxed);
+    }
+
+private:
+    Timer timer;
+    std::chrono::steady_clock::time_point start;
+};
+
+// {"rounds":[{"timers":{"name":{"calls":n,"ms":x},...},
+//             "counters":{"name":n,...}},...]}
+inline void write_json(std::ostream &out, const std::vector<Round> &rounds) {
+    std::ios::fmtflags flags = out.flags();
+    out << std::fixed << std::setprecision(3) << "{\"rounds\":[";
+    for (int r = 0; r < rounds.size(); r++) {
+        out << (r ? "," : "") << "{\"timers\":{";
+        for (int i = 0; i < NUM_TIMERS; i++)
+            out << (i ? "," : "") << '"' << timer_names[i] << "\":{"
+                << "\"calls\":" << rounds[r].calls[i] << ","
+                << "\"ms\":" << rounds[r].ns[i] * 1e-6 << "}";
+        out << "},\"counters\":{";
+        for (int i = 0; i < NUM_COUNTERS; i++)
+            out << (i ? "," : "") << '"' << counter_names[i] << "\":"
+                << rounds[r].counts[i];
+        out << "}}";
+    }
+    out << "]}";
+    out.flags(flags);
+}
+
+class Report {
+public:
+    Report() {
+        state().clear();
+    }
+
+    // Anything recorded after the last PERF_END_ROUND() is a round too.
+    ~Report() {
+        State &s = state();
+        s.end_round();
+        const Round &last = s.rounds.back();
+        bool empty = true;
+        for (int i = 0; i < NUM_TIMERS; i++)
+            empty = empty && last.calls[i] == 0;
+        for (int i = 0; i < NUM_COUNTERS; i++)
+            empty = empty && last.counts[i] == 0;
+        if (empty)
+            s.rounds.pop_back();
+        std::ostringstream json;
+        write_json(json, s.rounds);
+        LOG(LOG_INFO, "## perf = " << json.str().c_str());
+    }
+};
+
+}  // namespace perf
+
+
+#define PERF_SCOPE(name) perf::Scope perf_scope_##name(perf::name)
+#define PERF_COUNT(name, n) perf::add(perf::name, (n))
+#define PERF_END_ROUND() perf::state().end_round()
+#define PERF_REPORT_ON_EXIT() perf::Report perf_report
+
+#else
+
+#define PERF_SCOPE(name) do {} while (0)
+#define PERF_COUNT(name, n) do {} while (0)
+#define PERF_END_ROUND() do {} while (0)
+#define PERF_REPORT_ON_EXIT() do {} while (0)
+
+#endif
@@ -4,6 +4,7 @@ set -e -x
 clang++ \
     --std=c++0x -W -Wall -Wno-sign-compare \
     -O2 -pipe -mmmx -msse -msse2 -msse3 \
+    -pthread \
     -ggdb \
     -D_GLIBCXX_DEBUG -D_GLIBCXX_DEBUG_PEDANTIC \
     -fsanitize=address,integer,undefined \
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cassert>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <map>
+
+#include "observation.h"
+
+
+// Binary log of one tester session, for replaying it without the tester.
+// Everything is in native byte order:
+//
+//   "VIRSESS1"
+//   int32 med_strength, int32 kill_time, double spread_prob
+//   int32 n, then n times: int32 length, name bytes, double value
+//       (the planner parameters in effect)
+//   observation: the initial slide
+//   then records, each a one-byte tag followed by its fields:
+//     'A'  int32 x, int32 y, int32 reply      ADDMED
+//     'W'  int32 n, int32 reply               WAITTIME
+//     'O'  observation                        OBSERVE and its payload
+//     'E'                                     end of session
+//
+// where an observation is int32 h, int32 w, then the infected and the dead
+// bitmaps of Observation, h * words_per_row uint64 each.
+
+const char SESSION_MAGIC[8] = {'V', 'I', 'R', 'S', 'E', 'S', 'S', '1'};
+
+
+class SessionWriter {
+public:
+    explicit SessionWriter(const std::string &path)
+        : file(fopen(path.c_str(), "wb")) {
+        assert(file != nullptr);
+        write_bytes(SESSION_MAGIC, sizeof SESSION_MAGIC);
+    }
+
+    ~SessionWriter() {
+        write_tag('E');
+        fclose(file);
+    }
+
+    void start(const Observation &slide, int med_strength, int kill_time,
+               double spread_prob,
+               const std::map<std::string, double> &parameters) {
+        write_pod<int32_t>(med_strength);
+        write_pod<int32_t>(kill_time);
+        write_pod<double>(spread_prob);
+        write_pod<int32_t>((int32_t)parameters.size());
+        for (const auto &kv : parameters) {
+            write_pod<int32_t>((int32_t)kv.first.size());
+            write_bytes(kv.first.data(), kv.first.size());
+            write_pod<double>(kv.second);
+        }
+        write_observation(slide);
+        fflush(file);
+    }
+
+    void add_med(int x, int y, int reply) {
+        write_tag('A');
+        write_pod<int32_t>(x);
+        write_pod<int32_t>(y);
+        write_pod<int32_t>(reply);
+    }
+
+    void wait_time(int n, int reply) {
+        write_tag('W');
+        write_pod<int32_t>(n);
+        write_pod<int32_t>(reply);
+    }
+
+    // Flushed, so that a log cut short by a crash is good up to the last
+    // observation.
+    void observe(const Observation &obs) {
+        write_tag('O');
+        write_observation(obs);
+        fflush(file);
+    }
+
+private:
+    void write_bytes(const void *data, size_t size) {
+        size_t n = fwrite(data, 1, size, file);
+        assert(n == size);
+    }
+
+    template<typename T>
+    void write_pod(T value) {
+        write_bytes(&value, sizeof value);
+    }
+
+    void write_tag(char tag) {
+        write_bytes(&tag, 1);
+    }
+
+    void write_observation(const Observation &obs) {
+        write_pod<int32_t>(obs.h);
+        write_pod<int32_t>(obs.w);
+        write_bytes(obs.infected.data(), obs.infected.size() * sizeof(uint64_t));
+        write_bytes(obs.dead.data(), obs.dead.size() * sizeof(uint64_t));
+    }
+
+    FILE *file;
+};
+
+
+class SessionReader {
+public:
+    struct Record {
+        // 'A', 'W', 'O' or 'E'; 'E' also when the log is cut short.
+        char tag;
+        int x, y;  // ADDMED, or n in x for WAITTIME
+        int reply;
+        Observation obs;
+    };
+
+    Observation slide;
+    int med_strength, kill_time;
+    double spread_prob;
+    std::map<std::string, double> parameters;
+
+    explicit SessionReader(const std::string &path)
+        : file(fopen(path.c_str(), "rb")) {
+        assert(file != nullptr);
+        char magic[sizeof SESSION_MAGIC];
+        bool ok = read_bytes(magic, sizeof magic) &&
+                  std::equal(magic, magic + sizeof magic, SESSION_MAGIC);
+        assert(ok);
+        med_strength = read_pod<int32_t>();
+        kill_time = read_pod<int32_t>();
+        spread_prob = read_pod<double>();
+        int n = read_pod<int32_t>();
+        for (int i = 0; i < n; i++) {
+            std::string name((size_t)read_pod<int32_t>(), '\0');
+            ok = read_bytes(&name[0], name.size());
+            assert(ok);
+            parameters[name] = read_pod<double>();
+        }
+        ok = read_observation(slide);
+        assert(ok);
+    }
+
+    ~SessionReader() {
+        fclose(file);
+    }
+
+    Record next() {
+        Record r;
+        r.x = r.y = r.reply = 0;
+        if (!read_bytes(&r.tag, 1))
+            r.tag = 'E';
+        bool ok = true;
+        switch (r.tag) {
+            case 'A':
+                ok = read_int(r.x) && read_int(r.y) && read_int(r.reply);
+                break;
+            case 'W':
+                ok = read_int(r.x) && read_int(r.reply);
+                break;
+            case 'O':
+                ok = read_observation(r.obs);
+                break;
+            case 'E':
+                break;
+            default:
+                assert(false);
+        }
+        if (!ok)
+            r.tag = 'E';
+        return r;
+    }
+
+private:
+    bool read_bytes(void *data, size_t size) {
+        return fread(data, 1, size, file) == size;
+    }
+
+    bool read_int(int &value) {
+        int32_t v;
+        if (!read_bytes(&v, sizeof v))
+            return false;
+        value = v;
+        return true;
+    }
+
+    // Only for the header, which must be complete.
+    template<typename T>
+    T read_pod() {
+        T value;
+        bool ok = read_bytes(&value, sizeof value);
+        assert(ok);
+        return value;
+    }
+
+    bool read_observation(Observation &obs) {
+        int h, w;
+        if (!read_int(h) || !read_int(w))
+            return false;
+        assert(h > 0 && w > 0);
+        obs = Observation(w, h);
+        if (!read_bytes(obs.infected.data(), obs.infected.size() * sizeof(uint64_t)) ||
+            !read_bytes(obs.dead.data(), obs.dead.size() * sizeof(uint64_t)))
+            return false;
+        obs.recount();
+        return true;
+    }
+
+    FILE *file;
+};
@@ -0,0 +1,20 @@
+set -e -x
+
+# Runs the planner against the in-process simulator (no JVM, no pipes).
+# Usage: ./sim.sh [FROM [TO]] [param value ...]
+#        ./sim.sh FROM TO -sweep param v1,v2,... [-sweep ...] [-jobs N]
+# Extra compiler flags come from CXXFLAGS, e.g. CXXFLAGS=-DPERF_STATS.
+
+FROM=${1:-1}
+TO=${2:-100}
+shift 2 || true
+
+clang++ \
+    --std=c++0x -W -Wall -Wno-sign-compare \
+    -O2 -pipe -mmmx -msse -msse2 -msse3 \
+    -pthread \
+    -ggdb \
+    $CXXFLAGS \
+    main.cc -o main_sim
+
+time ./main_sim -seeds $FROM $TO "$@"
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+using namespace std;
+
+
+// Bit-exact port of java.util.Random, so that seeds reproduce the tester.
+// Arithmetic is arranged to never overflow (run.sh builds with
+// -fsanitize=integer).
+class JavaRandom {
+    static const uint64_t MULTIPLIER = 0x5DEECE66DULL;
+    static const uint64_t MASK = (1ULL << 48) - 1;
+
+    uint64_t seed;
+
+public:
+    explicit JavaRandom(int64_t seed = 0) {
+        set_seed(seed);
+    }
+
+    void set_seed(int64_t s) {
+        seed = ((uint64_t)s ^ MULTIPLIER) & MASK;
+    }
+
+    int next(int bits) {
+        // seed * MULTIPLIER + 0xB (mod 2^48), split to stay within 64 bits.
+        uint64_t lo = seed & 0xFFFFFF;
+        uint64_t hi = seed >> 24;
+        seed = (lo * MULTIPLIER +
+                (((hi * MULTIPLIER) & 0xFFFFFF) << 24) + 0xB) & MASK;
+        return (int32_t)(uint32_t)(seed >> (48 - bits));
+    }
+
+    int nextInt(int bound) {
+        assert(bound > 0);
+        int r = next(31);
+        int m = bound - 1;
+        if ((bound & m) == 0)
+            return (int)(((int64_t)bound * r) >> 31);
+        for (int64_t u = r; u - (r = u % bound) + m > INT32_MAX; u = next(31)) {
+        }
+        return r;
+    }
+
+    double nextDouble() {
+        return (((int64_t)next(26) << 27) + next(27)) * (1.0 / (1LL << 53));
+    }
+};
+
+
+// In-process reimplementation of tester/ViralInfectionVis.java (the parts
+// that matter for scoring: test generation, incrementTime and friends).
+class Simulator {
+public:
+    static const int MAX_TIME = 10000;
+
+    int width, height;
+    int med_strength;
+    int kill_time;
+    double spread_prob;
+
+    int med_count;
+    int time_count;
+
+private:
+    JavaRandom r;
+    vector<vector<int>> virus;
+    vector<vector<double>> med;
+
+public:
+    explicit Simulator(int64_t seed) : med_count(0), time_count(0) {
+        r.set_seed(seed);
+        med_strength = r.nextInt(91) + 10;
+        kill_time = r.nextInt(10) + 1;
+        spread_prob = r.nextDouble() * 0.75 + 0.25;
+        height = r.nextInt(86) + 15;
+        width = r.nextInt(86) + 15;
+        if (seed < 5)
+            width = height = 10 + 5 * (int)seed;
+
+        virus.assign(height, vector<int>(width, 0));
+        med.assign(height, vector<double>(width, 0.0));
+        int num_virus = kill_time + r.nextInt(height * width / 10);
+        int num_dead = r.nextInt(height * width / 10);
+        while (num_dead > 0) {
+            int y = r.nextInt(height);
+            int x = r.nextInt(width);
+            if (virus[y][x] != 0) continue;
+            virus[y][x] = -1;
+            num_dead--;
+        }
+        while (num_virus > 0) {
+            int y = r.nextInt(height);
+            int x = r.nextInt(width);
+            if (virus[y][x] != 0) continue;
+            virus[y][x] = kill_time;
+            num_virus--;
+        }
+        r.set_seed(seed ^ 987654321987654321LL);
+    }
+
+    vector<string> status() const {
+        vector<string> result(height, string(width, 'C'));
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                if (virus[y][x] != 0)
+                    result[y][x] = virus[y][x] > 0 ? 'V' : 'X';
+        return result;
+    }
+
+    int addMed(int x, int y) {
+        if (x < 0 || y < 0 || x >= width || y >= height)
+            return -1;
+        if (time_count >= MAX_TIME)
+            return -1;
+        med[y][x] += med_strength;
+        med_count++;
+        increment_time();
+        return 0;
+    }
+
+    vector<string> observe() {
+        auto result = status();
+        increment_time();
+        return result;
+    }
+
+    int waitTime(int units) {
+        if (units < 1 || time_count + units > MAX_TIME)
+            return -1;
+        for (int i = 0; i < units && time_count < MAX_TIME; i++)
+            increment_time();
+        return 0;
+    }
+
+    bool done() const {
+        if (time_count >= MAX_TIME)
+            return true;
+        for (const auto &row : virus)
+            for (int v : row)
+                if (v > 0)
+                    return false;
+        return true;
+    }
+
+    // What the tester does after runSim returns.
+    double finish_and_score() {
+        while (!done())
+            increment_time();
+        int healthy = 0;
+        for (const auto &row : virus)
+            healthy += count(row.begin(), row.end(), 0);
+        return max(
+            (healthy - med_count * 0.5) / max(time_count, 1), 0.0);
+    }
+
+private:
+    void increment_time() {
+        process_meds();
+        process_viruses();
+        diffuse();
+        time_count++;
+    }
+
+    void process_meds() {
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                if (virus[y][x] > 0 && med[y][x] >= 1.0)
+                    virus[y][x] = 0;
+    }
+
+    void process_viruses() {
+        for (auto &row : virus)
+            for (int &v : row) {
+                if (v <= 0) continue;
+                v--;
+                if (v == 0)
+                    v = -2;
+            }
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                if (virus[y][x] == -2) {
+                    virus[y][x] = -1;
+                    spread_virus(x, y);
+                }
+    }
+
+    void spread_virus(int x, int y) {
+        // Order of RNG calls matters, it's the same as in the tester.
+        if (x > 0 && virus[y][x - 1] == 0 && r.nextDouble() < spread_prob)
+            virus[y][x - 1] = kill_time;
+        if (x < width - 1 && virus[y][x + 1] == 0 &&
+            r.nextDouble() < spread_prob)
+            virus[y][x + 1] = kill_time;
+        if (y > 0 && virus[y - 1][x] == 0 && r.nextDouble() < spread_prob)
+            virus[y - 1][x] = kill_time;
+        if (y < height - 1 && virus[y + 1][x] == 0 &&
+            r.nextDouble() < spread_prob)
+            virus[y + 1][x] = kill_time;
+    }
+
+    void diffuse() {
+        // Same accumulation order as the tester, so results are bit-exact.
+        vector<vector<double>> diff(height, vector<double>(width, 0.0));
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++) {
+                if (x > 0) {
+                    diff[y][x - 1] += (med[y][x] - med[y][x - 1]) * 0.2;
+                    diff[y][x] += (med[y][x - 1] - med[y][x]) * 0.2;
+                }
+                if (y > 0) {
+                    diff[y - 1][x] += (med[y][x] - med[y - 1][x]) * 0.2;
+                    diff[y][x] += (med[y - 1][x] - med[y][x]) * 0.2;
+                }
+            }
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                med[y][x] += diff[y][x];
+    }
+};
@@ -8,78 +8,277 @@
 #include <thread>
 #include <chrono>
 #include <functional>
+#include <cstdint>
+#include <climits>
+#include <queue>
+#include <memory>
+#include <numeric>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "pretty_printing.h"
+#include "worker_pool.h"
+#include "observation.h"
+#include "perf.h"
+#include "log.h"
 
 using namespace std;
 
 
-#define debug(x) cerr << #x " = " << (x) << endl
-#define debug2(x, y) cerr << #x " = " << (x) << ", " #y " = " << y << endl
-#define debug3(x, y, z) \
-    cerr << #x " = " << (x) << ", " #y " = " << y << ", " #z " = " << z << endl
+bool has_infection(const Observation &obs) {
+    return obs.num_infected > 0;
+}
 
 
-typedef vector<string> Slide;
+// Side of the square tiles that the grids track activity by.
+const int TILE = 8;
 
-bool has_infection(const Slide &slide) {
-    for (const auto &row : slide)
-        if (row.find('V') != string::npos)
-            return true;
-    return false;
+// Medicine concentration, flat row-major w x h grid.
+struct MedField {
+    int w, h;
+    vector<double> values;
+    // Per TILE x TILE tile: whether it may hold a nonzero value. Writes
+    // through the non-const at() set it; whoever writes values directly
+    // sets it as well.
+    int tiles_x, tiles_y;
+    vector<char> tile_nonzero;
+
+    MedField() : w(0), h(0), tiles_x(0), tiles_y(0) {}
+
+    MedField(int w, int h)
+        : w(w), h(h), values(w * h, 0.0),
+          tiles_x((w + TILE - 1) / TILE), tiles_y((h + TILE - 1) / TILE),
+          tile_nonzero(tiles_x * tiles_y, 0) {}
+
+    double at(int x, int y) const {
+        assert(x >= 0 && x < w);
+        assert(y >= 0 && y < h);
+        return values[x + w * y];
+    }
+
+    double &at(int x, int y) {
+        assert(x >= 0 && x < w);
+        assert(y >= 0 && y < h);
+        tile_nonzero[x / TILE + tiles_x * (y / TILE)] = 1;
+        return values[x + w * y];
+    }
+
+    void mark(int x, int y) {
+        tile_nonzero[x / TILE + tiles_x * (y / TILE)] = 1;
+    }
+
+    bool may_be_nonzero(int tx, int ty) const {
+        return tile_nonzero[tx + tiles_x * ty] != 0;
+    }
+};
+
+
+// Copy of the rectangle [x1, x2) x [y1, y2) of a MedField. Reads outside
+// of it are not allowed.
+struct MedWindow {
+    int x1, y1, x2, y2;
+    vector<double> values;
+
+    MedWindow(const MedField &med, int x1, int y1, int x2, int y2)
+        : x1(x1), y1(y1), x2(x2), y2(y2) {
+        assert(0 <= x1 && x1 <= x2 && x2 <= med.w);
+        assert(0 <= y1 && y1 <= y2 && y2 <= med.h);
+        values.reserve((x2 - x1) * (y2 - y1));
+        for (int y = y1; y < y2; y++)
+            values.insert(values.end(),
+                          med.values.begin() + x1 + med.w * y,
+                          med.values.begin() + x2 + med.w * y);
+    }
+
+    double at(int x, int y) const {
+        assert(x >= x1 && x < x2);
+        assert(y >= y1 && y < y2);
+        return values[x - x1 + (x2 - x1) * (y - y1)];
+    }
+};
+
+
+// Flux terms are added in the same order as in the tester's diffuse()
+// (left, up, right, down), so the result is bit-exact with it.
+// Missing neighbors at the border are replaced with the cell itself,
+// which contributes exactly zero flux.
+inline double diffuse_cell(double c, double l, double u, double r, double d) {
+    return c + ((((l - c) * 0.2 + (u - c) * 0.2) + (r - c) * 0.2) +
+                (d - c) * 0.2);
 }
 
+// Diffuses [x0, x1) of one row. up and down are the rows above and below,
+// or the row itself at the border.
+inline void diffuse_span(const double *row, const double *up,
+                         const double *down, double *out,
+                         int w, int x0, int x1) {
+    int x = x0;
+    if (x == 0) {
+        out[0] = diffuse_cell(
+            row[0], row[0], up[0], w > 1 ? row[1] : row[0], down[0]);
+        x = 1;
+    }
+    int end = min(x1, w - 1);
+#ifdef __SSE2__
+    const __m128d k = _mm_set1_pd(0.2);
+    for (; x + 2 <= end; x += 2) {
+        __m128d c = _mm_loadu_pd(row + x);
+        __m128d fl = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(row + x - 1), c), k);
+        __m128d fu = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(up + x), c), k);
+        __m128d fr = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(row + x + 1), c), k);
+        __m128d fd = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(down + x), c), k);
+        __m128d diff = _mm_add_pd(_mm_add_pd(_mm_add_pd(fl, fu), fr), fd);
+        _mm_storeu_pd(out + x, _mm_add_pd(c, diff));
+    }
+#endif
+    for (; x < end; x++)
+        out[x] = diffuse_cell(row[x], row[x - 1], up[x], row[x + 1], down[x]);
+    if (x1 == w && w > 1)
+        out[w - 1] = diffuse_cell(
+            row[w - 1], row[w - 2], up[w - 1], row[w - 1], down[w - 1]);
+}
 
-template<typename Matrix>
-void diffusion_step(const Matrix &cur, Matrix &next) {
+// Computes next from cur in one pass (5-point gather, no copy). Tiles
+// whose 3x3 tile neighborhood is all zero in cur stay zero and are only
+// cleared if next may hold something there.
+void diffusion_step(const MedField &cur, MedField &next) {
     assert(&cur != &next);
-    next = cur;
-    for (int i = 0; i < cur.size(); i++) {
-        for (int j = 0; j < cur.front().size(); j++) {
-            if (i > 0) {
-                double d = (cur[i][j] - cur[i - 1][j]) * 0.2;
-                next[i - 1][j] += d;
-                next[i][j] -= d;
+    assert(cur.w == next.w && cur.h == next.h);
+    int w = cur.w;
+    int h = cur.h;
+    for (int ty = 0; ty < cur.tiles_y; ty++)
+        for (int tx = 0; tx < cur.tiles_x; tx++) {
+            bool active = false;
+            for (int y = max(ty - 1, 0); y <= min(ty + 1, cur.tiles_y - 1); y++)
+                for (int x = max(tx - 1, 0); x <= min(tx + 1, cur.tiles_x - 1); x++)
+                    active = active || cur.tile_nonzero[x + cur.tiles_x * y];
+
+            int x0 = tx * TILE, x1 = min(x0 + TILE, w);
+            int y0 = ty * TILE, y1 = min(y0 + TILE, h);
+            char &flag = next.tile_nonzero[tx + cur.tiles_x * ty];
+            if (!active) {
+                if (flag)
+                    for (int y = y0; y < y1; y++)
+                        fill(next.values.begin() + w * y + x0,
+                             next.values.begin() + w * y + x1, 0.0);
+                flag = 0;
+                continue;
             }
-            if (j > 0) {
-                double d = (cur[i][j] - cur[i][j - 1]) * 0.2;
-                next[i][j - 1] += d;
-                next[i][j] -= d;
+            flag = 0;
+            for (int y = y0; y < y1; y++) {
+                const double *row = cur.values.data() + w * y;
+                const double *up = y > 0 ? row - w : row;
+                const double *down = y + 1 < h ? row + w : row;
+                double *out = next.values.data() + w * y;
+                diffuse_span(row, up, down, out, w, x0, x1);
+                for (int x = x0; x < x1; x++)
+                    flag = flag || out[x] != 0.0;
             }
         }
-    }
 }
 
 
-const int M = 6;
+// Footprints look at most M cells and M ticks away from the drop. M is a
+// template parameter of the kernels that depend on it (Diffusion and the
+// footprint loop); the horizon used for a case is picked at runtime from
+// the instantiations in make_footprint_kernel(). PointSet windows are
+// sized for the largest one.
+const int MAX_M = 7;
+
+template<int M>
 class Diffusion {
     int w, h;
     int med_strength;
 
     array<array<array<double, 2*M + 1>, 2*M + 1>, M + 1> i_prop;
 
+    // Walls are handled with the method of images: the no-flux boundary
+    // at -0.5 is the same as an extra drop mirrored at -1 - x (and the same
+    // for the other walls), which is exact for the discrete diffusion.
+    // Drops whose images are within reach are grouped into classes by
+    // their image offsets along each axis; for every pair of classes the
+    // kernel with all images folded in is precomputed.
+    vector<int> x_class, y_class;
+    int num_y_classes;
+    // [x_class][y_class][dt][dy + M][dx + M]
+    vector<double> folded;
+
+    static void classify_axis(
+        int n, vector<int> &cls, vector<vector<int>> &offsets) {
+        map<vector<int>, int> ids;
+        cls.resize(n);
+        for (int p = 0; p < n; p++) {
+            vector<int> image_offsets;
+            int k_max = 2*M / n + 2;
+            for (int k = -k_max; k <= k_max; k++) {
+                for (int o : {2*k*n, 2*k*n - 1 - 2*p})
+                    if (abs(o) <= 2*M)
+                        image_offsets.push_back(o);
+            }
+            sort(image_offsets.begin(), image_offsets.end());
+            auto it = ids.find(image_offsets);
+            if (it == ids.end()) {
+                it = ids.emplace(image_offsets, offsets.size()).first;
+                offsets.push_back(image_offsets);
+            }
+            cls[p] = it->second;
+        }
+    }
+
+    static int folded_idx(int cx, int cy, int num_y_classes,
+                          int dt, int dx, int dy) {
+        return (((cx * num_y_classes + cy) * (M + 1) + dt) * (2*M + 1) +
+                dy + M) * (2*M + 1) + dx + M;
+    }
+
 public:
     Diffusion() {}
 
     Diffusion(int w, int h, int med_strength) : w(w), h(h) {
-        for (int i = 0; i < 2*M + 1; i++)
-            for (int j = 0; j < 2*M + 1; j++)
-                i_prop[0][i][j] = 0.0;
-        i_prop[0][M][M] = med_strength;
-        for (int t = 1; t < i_prop.size(); t++) {
-            auto &cur = i_prop[t - 1];
-            auto &next = i_prop[t];
-            diffusion_step(cur, next);
-
-            // for (const auto &row : next) {
+        PERF_SCOPE(diffusion_build);
+        MedField cur(2*M + 1, 2*M + 1);
+        MedField next(2*M + 1, 2*M + 1);
+        cur.at(M, M) = med_strength;
+        for (int t = 0; t < i_prop.size(); t++) {
+            if (t > 0) {
+                diffusion_step(cur, next);
+                swap(cur, next);
+            }
+            for (int i = 0; i < 2*M + 1; i++)
+                for (int j = 0; j < 2*M + 1; j++)
+                    i_prop[t][i][j] = cur.at(j, i);
+
+            // for (const auto &row : i_prop[t]) {
             //     for (double cell : row)
             //         cerr << setw(5) << (int)(cell * 1000);
             //     cerr << endl;
             // }
             // cerr << endl;
         }
+
+        vector<vector<int>> x_offsets, y_offsets;
+        classify_axis(w, x_class, x_offsets);
+        classify_axis(h, y_class, y_offsets);
+        num_y_classes = y_offsets.size();
+
+        folded.assign(
+            x_offsets.size() * y_offsets.size() * i_prop.size() *
+            (2*M + 1) * (2*M + 1), 0.0);
+        for (int cx = 0; cx < x_offsets.size(); cx++)
+            for (int cy = 0; cy < y_offsets.size(); cy++)
+                for (int dt = 0; dt < i_prop.size(); dt++)
+                    for (int dy = -M; dy <= M; dy++)
+                        for (int dx = -M; dx <= M; dx++) {
+                            double &f = folded[folded_idx(
+                                cx, cy, num_y_classes, dt, dx, dy)];
+                            for (int ox : x_offsets[cx])
+                                for (int oy : y_offsets[cy])
+                                    f += reach(dx - ox, dy - oy, dt);
+                        }
     }
 
+    // Free space propagation.
     double reach(int dx, int dy, int dt) const {
         assert(dt >= 0);
         if (dt >= i_prop.size())
@@ -91,9 +290,21 @@ public:
         return i_prop[dt][dx + M][dy + M];
     }
 
+    // Propagation from the drop at (x2, y2) to (x1, y1), walls included.
     double reach(int x1, int y1, int x2, int y2, int dt) const {
-        // TODO: reflections
-        return reach(x1 - x2, y1 - y2, dt);
+        assert(x1 >= 0 && x1 < w && y1 >= 0 && y1 < h);
+        assert(x2 >= 0 && x2 < w && y2 >= 0 && y2 < h);
+        assert(dt >= 0);
+        int dx = x1 - x2;
+        int dy = y1 - y2;
+        if (dt >= i_prop.size())
+            return 0.0;
+        if (dx < -M || dx > M)
+            return 0.0;
+        if (dy < -M || dy > M)
+            return 0.0;
+        return folded[folded_idx(
+            x_class[x2], y_class[y2], num_y_classes, dt, dx, dy)];
     }
 };
 
@@ -103,41 +314,131 @@ int kill_time = -1;
 double spread_prob = -1.0;
 int w = -1;
 int h = -1;
-Diffusion diffusion;
+// The M of the footprint kernel in use.
+int horizon = -1;
 
 map<string, double> parameters = {
     {"frontier_discount_factor", 0.02},
     {"tto", 3},
+    // Planning threads, 0 means one per core.
+    {"threads", 0},
+    // Build each round's predictions on top of the previous round's.
+    {"incremental", 1},
+    // Keep predicted medicine only near infection, see Modeller::compact.
+    // Turns off incremental.
+    {"compact_predictions", 0},
+    // Predict medicine from the drops of the last horizon ticks, see
+    // DropField. Implies compact_predictions.
+    {"analytic_med", 0},
+    // Wall-clock limit for one make_plan() call, 0 means no limit.
+    {"plan_budget_ms", 0},
+    // Time for local search after greedy in each make_plan(), 0 skips it.
+    // Cut short by plan_budget_ms.
+    {"improve_budget_ms", 0},
+    // Futures / 64 for the sampled simulation, 0 uses Distr instead.
+    {"monte_carlo_words", 0},
+    // Footprint horizon M, see MAX_M.
+    {"horizon", 6},
+    // Ticks between observations when kill_time is 1.
+    {"tto_kill_time_1", 3},
+    // For kill_time in [2, tto_double_max_kill_time] and spread_prob below
+    // tto_double_max_spread, observe every 2 kill_time ticks instead of
+    // every kill_time.
+    {"tto_double_max_kill_time", 6},
+    {"tto_double_max_spread", 4.4},
 };
 
 
+WorkerPool &worker_pool() {
+    static WorkerPool *pool = nullptr;
+    int n = parameters.at("threads");
+    if (n <= 0)
+        n = max<int>(thread::hardware_concurrency(), 1);
+    if (pool == nullptr || pool->size() != n) {
+        delete pool;
+        pool = new WorkerPool(n);
+    }
+    return *pool;
+}
+
+
+// Set of cells within the (2 MAX_M + 1)^2 window around the drop at
+// (cx, cy).
+// Row r of the window is a bitmask, bit i is the point (ox + i, oy + r).
 struct PointSet {
-    set<pair<int, int>> points;
+    int ox, oy;
+    array<uint32_t, 2*MAX_M + 1> rows;
+    int count;
     int min_idx;
     int max_idx;
-    // TODO: add orthogonal index
 
-    PointSet() : min_idx(100000), max_idx(-1) {}
+    PointSet() : ox(0), oy(0), count(0), min_idx(100000), max_idx(-1) {
+        rows.fill(0);
+    }
+
+    PointSet(int cx, int cy)
+        : ox(cx - MAX_M), oy(cy - MAX_M), count(0), min_idx(100000), max_idx(-1) {
+        rows.fill(0);
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    int size() const {
+        return count;
+    }
 
     void add_point(int x, int y) {
         assert(x >= 0);
         assert(x < ::w);
         assert(y >= 0);
         assert(y < ::h);
+        assert(x >= ox && x <= ox + 2*MAX_M);
+        assert(y >= oy && y <= oy + 2*MAX_M);
         int idx = x + w * y;
         min_idx = min(min_idx, idx);
         max_idx = max(max_idx, idx);
-        points.emplace(x, y);
+        uint32_t &row = rows[y - oy];
+        uint32_t bit = 1u << (x - ox);
+        if ((row & bit) == 0) {
+            row |= bit;
+            count++;
+        }
+    }
+
+    template<typename F>
+    void for_each_point(F f) const {
+        for (int r = 0; r < rows.size(); r++) {
+            for (uint32_t bits = rows[r]; bits; bits &= bits - 1)
+                f(ox + __builtin_ctz(bits), oy + r);
+        }
     }
 
     bool dominates(const PointSet &other) const {
-        if (points.size() < other.points.size())
+        if (count < other.count)
             return false;
+        if (other.count == 0)
+            return true;
 
         if (min_idx > other.min_idx || max_idx < other.max_idx)
             return false;
-        for (auto pt : other.points) {
-            if (points.count(pt) == 0)
+
+        int dx = other.ox - ox;
+        int dy = other.oy - oy;
+        if (abs(dx) > 2*MAX_M || abs(dy) > 2*MAX_M)
+            return false;
+        // Both rows are shifted to a common 64-bit frame, no bits are lost.
+        const int base = 32;
+        for (int r = 0; r < other.rows.size(); r++) {
+            if (other.rows[r] == 0)
+                continue;
+            int r2 = r + dy;
+            if (r2 < 0 || r2 >= rows.size())
+                return false;
+            uint64_t mine = (uint64_t)rows[r2] << base;
+            uint64_t theirs = (uint64_t)other.rows[r] << (base + dx);
+            if (theirs & ~mine)
                 return false;
         }
         return true;
@@ -214,92 +515,389 @@ struct Distr {
 };
 
 
-typedef vector<vector<Distr>> Model;
+// Infection probability above which a cell counts as active.
+const double ACTIVE_PROB = 1e-8;
 
 
-Model slide_to_model(const vector<string> &slide) {
-    vector<vector<Distr>> slide_model(
-        slide.size() + 2, vector<Distr>(slide[0].size() + 2, Distr::clean()));
+// Padded grid of cell distributions, stored as two flat planes
+// (structure of arrays). Coordinates are padded: cells are (1..w, 1..h),
+// row and column 0 and w + 1, h + 1 are a clean halo, so that the spread
+// kernel doesn't need bounds checks.
+struct Model {
+    int w, h;
+    int stride;
+    vector<double> clean_prob;
+    vector<double> inf_prob;
+
+    // Number of active cells and a bounding box (padded, inclusive) that
+    // contains all of them. update_model() and cure_model() keep them up
+    // to date; after cures the box can be larger than necessary. Whoever
+    // writes inf_prob directly calls recount().
+    int num_active;
+    int active_x1, active_y1, active_x2, active_y2;
+
+    // Per TILE x TILE tile of the unpadded grid: how many of its cells
+    // have nonzero inf_prob. Same maintenance as num_active.
+    int tiles_x, tiles_y;
+    vector<int> tile_infected;
+
+    Model() : w(0), h(0), stride(0), tiles_x(0), tiles_y(0) {
+        clear_active();
+    }
+
+    Model(int w, int h)
+        : w(w), h(h), stride(w + 2),
+          clean_prob((w + 2) * (h + 2), 1.0),
+          inf_prob((w + 2) * (h + 2), 0.0),
+          tiles_x((w + TILE - 1) / TILE), tiles_y((h + TILE - 1) / TILE),
+          tile_infected(tiles_x * tiles_y, 0) {
+        clear_active();
+    }
 
-    for (int i = 0; i < slide.size(); i++) {
-        for (int j = 0; j < slide[0].size(); j++) {
-            Distr &c = slide_model[i + 1][j + 1];
-            switch (slide[i][j]) {
-                case 'C': c = Distr::clean(); break;
-                case 'X': c = Distr::dead(); break;
-                case 'V': c = Distr::infected(); break;
-                default: assert(false); break;
+    // Tile of padded cell (x, y).
+    int tile(int x, int y) const {
+        return (x - 1) / TILE + tiles_x * ((y - 1) / TILE);
+    }
+
+    // Bookkeeping for inf_prob of padded (x, y) going from before to after.
+    void inf_changed(int x, int y, double before, double after) {
+        if (before > ACTIVE_PROB)
+            num_active--;
+        if (after > ACTIVE_PROB)
+            add_active(x, y);
+        tile_infected[tile(x, y)] += (after != 0.0) - (before != 0.0);
+    }
+
+    void clear_active() {
+        num_active = 0;
+        active_x1 = active_y1 = INT_MAX;
+        active_x2 = active_y2 = INT_MIN;
+    }
+
+    void add_active(int x, int y) {
+        num_active++;
+        active_x1 = min(active_x1, x);
+        active_y1 = min(active_y1, y);
+        active_x2 = max(active_x2, x);
+        active_y2 = max(active_y2, y);
+    }
+
+    // Unpadded cells [x1, x2) x [y1, y2) of the smallest box of whole
+    // tiles that holds every cell with nonzero inf_prob; empty if none.
+    void infected_box(int &x1, int &y1, int &x2, int &y2) const {
+        int tx1 = tiles_x, ty1 = tiles_y, tx2 = -1, ty2 = -1;
+        for (int ty = 0; ty < tiles_y; ty++)
+            for (int tx = 0; tx < tiles_x; tx++)
+                if (tile_infected[tx + tiles_x * ty] > 0) {
+                    tx1 = min(tx1, tx);
+                    ty1 = min(ty1, ty);
+                    tx2 = max(tx2, tx);
+                    ty2 = max(ty2, ty);
+                }
+        if (tx2 < 0) {
+            x1 = y1 = x2 = y2 = 0;
+            return;
+        }
+        x1 = tx1 * TILE;
+        y1 = ty1 * TILE;
+        x2 = min((tx2 + 1) * TILE, w);
+        y2 = min((ty2 + 1) * TILE, h);
+    }
+
+    void recount() {
+        clear_active();
+        fill(tile_infected.begin(), tile_infected.end(), 0);
+        for (int y = 1; y <= h; y++)
+            for (int x = 1; x <= w; x++) {
+                if (inf_prob[idx(x, y)] > ACTIVE_PROB)
+                    add_active(x, y);
+                if (inf_prob[idx(x, y)] != 0.0)
+                    tile_infected[tile(x, y)]++;
             }
+    }
+
+    int idx(int x, int y) const {
+        assert(x >= 0 && x < stride);
+        assert(y >= 0 && y < h + 2);
+        return x + stride * y;
+    }
+
+    Distr get(int x, int y) const {
+        int i = idx(x, y);
+        return Distr(clean_prob[i], inf_prob[i]);
+    }
+
+    void set(int x, int y, const Distr &d) {
+        int i = idx(x, y);
+        clean_prob[i] = d.clean_prob;
+        inf_prob[i] = d.inf_prob;
+    }
+
+    void cure(int x, int y) {
+        int i = idx(x, y);
+        clean_prob[i] += inf_prob[i];
+        inf_prob[i] = 0.0;
+    }
+};
+
+
+// Copy of the padded cells [x1, x2) x [y1, y2) of a Model, along with
+// its active cell count and box. Reads outside of it are not allowed.
+struct ModelWindow {
+    int x1, y1, x2, y2;
+    vector<double> clean_prob;
+    vector<double> inf_prob;
+    int num_active;
+    int active_x1, active_y1, active_x2, active_y2;
+
+    ModelWindow(int x1, int y1, int x2, int y2)
+        : x1(x1), y1(y1), x2(x2), y2(y2), num_active(0),
+          active_x1(INT_MAX), active_y1(INT_MAX),
+          active_x2(INT_MIN), active_y2(INT_MIN) {
+        assert(x1 <= x2 && y1 <= y2);
+    }
+
+    void copy_from(const Model &model) {
+        assert(0 <= x1 && x2 <= model.stride);
+        assert(0 <= y1 && y2 <= model.h + 2);
+        clean_prob.clear();
+        inf_prob.clear();
+        clean_prob.reserve((x2 - x1) * (y2 - y1));
+        inf_prob.reserve((x2 - x1) * (y2 - y1));
+        for (int y = y1; y < y2; y++) {
+            int row = model.idx(0, y);
+            clean_prob.insert(clean_prob.end(),
+                              model.clean_prob.begin() + row + x1,
+                              model.clean_prob.begin() + row + x2);
+            inf_prob.insert(inf_prob.end(),
+                            model.inf_prob.begin() + row + x1,
+                            model.inf_prob.begin() + row + x2);
         }
+        num_active = model.num_active;
+        active_x1 = model.active_x1;
+        active_y1 = model.active_y1;
+        active_x2 = model.active_x2;
+        active_y2 = model.active_y2;
     }
 
+    bool contains(int x, int y) const {
+        return x >= x1 && x < x2 && y >= y1 && y < y2;
+    }
+
+    int idx(int x, int y) const {
+        assert(contains(x, y));
+        return x - x1 + (x2 - x1) * (y - y1);
+    }
+};
+
+
+Model slide_to_model(const Observation &obs) {
+    Model slide_model(obs.w, obs.h);
+
+    for (int i = 0; i < obs.h; i++) {
+        for (int j = 0; j < obs.w; j++) {
+            Distr c = Distr::clean();
+            if (obs.is_infected(j, i))
+                c = Distr::infected();
+            else if (obs.is_dead(j, i))
+                c = Distr::dead();
+            slide_model.set(j + 1, i + 1, c);
+        }
+    }
+    slide_model.recount();
+
     return slide_model;
 }
 
 
 void show_model(ostream &out, const Model &model) {
-    int w = min<int>(model[0].size() - 2, 20);
-    int h = min<int>(model.size() - 2, 20);
+    int w = min(model.w, 20);
+    int h = min(model.h, 20);
     for (int i = 1; i <= h; i++) {
         for (int j = 1; j <= w; j++) {
-            int q = model[i][j].clean_prob * 8.0002 + 0.9999;
+            int q = model.clean_prob[model.idx(j, i)] * 8.0002 + 0.9999;
             if (q) out << q; else out << ' ';
             out << ',';
-            q = model[i][j].inf_prob * 8.0002 + 0.9999;
+            q = model.inf_prob[model.idx(j, i)] * 8.0002 + 0.9999;
             if (q) out << q; else out << ' ';
             out << "  ";
         }
-        out << endl;
+        out << '\n';
+    }
+}
+
+
+// Spread kernel for cells [begin, end) of one row (flat indices).
+// Same operation order as Distr::step(left, right, up, down), so results
+// are bit-identical to the scalar version.
+void spread_row(const double *clean, const double *inf,
+                int stride, double p, int begin, int end,
+                double *next_clean, double *next_inf) {
+    int k = begin;
+#ifdef __SSE2__
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d pp = _mm_set1_pd(p);
+    for (; k + 2 <= end; k += 2) {
+        __m128d f1 = _mm_sub_pd(one, _mm_mul_pd(_mm_loadu_pd(inf + k - 1), pp));
+        __m128d f2 = _mm_sub_pd(one, _mm_mul_pd(_mm_loadu_pd(inf + k + 1), pp));
+        __m128d f3 = _mm_sub_pd(
+            one, _mm_mul_pd(_mm_loadu_pd(inf + k - stride), pp));
+        __m128d f4 = _mm_sub_pd(
+            one, _mm_mul_pd(_mm_loadu_pd(inf + k + stride), pp));
+        __m128d nip = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(f1, f2), f3), f4);
+        __m128d c = _mm_loadu_pd(clean + k);
+        _mm_storeu_pd(next_clean + k, _mm_mul_pd(c, nip));
+        _mm_storeu_pd(next_inf + k, _mm_mul_pd(c, _mm_sub_pd(one, nip)));
+    }
+#endif
+    for (; k < end; k++) {
+        double nip =
+            (1.0 - inf[k - 1] * p) *
+            (1.0 - inf[k + 1] * p) *
+            (1.0 - inf[k - stride] * p) *
+            (1.0 - inf[k + stride] * p);
+        next_clean[k] = clean[k] * nip;
+        next_inf[k] = clean[k] * (1.0 - nip);
     }
 }
 
+// next must start out as a copy of cur: tiles with no infection in their
+// 3x3 tile neighborhood would not change and are skipped. Debug builds
+// (_GLIBCXX_DEBUG, see run.sh) check that skipped tiles match cur.
 void update_model(const Model &cur, Model &next) {
     assert(&cur != &next);
-    assert(cur.size() == next.size());
-    assert(cur[0].size() == next[0].size());
-    for (int i = 1; i < cur.size() - 1; i++) {
-        for (int j = 1; j < cur[0].size() - 1; j++) {
-            next[i][j] = cur[i][j].step(
-                cur[i][j - 1], cur[i][j + 1],
-                cur[i - 1][j], cur[i + 1][j]);
+    assert(cur.w == next.w);
+    assert(cur.h == next.h);
+    next.clear_active();
+    for (int ty = 0; ty < cur.tiles_y; ty++)
+        for (int tx = 0; tx < cur.tiles_x; tx++) {
+            bool active = false;
+            for (int y = max(ty - 1, 0); y <= min(ty + 1, cur.tiles_y - 1); y++)
+                for (int x = max(tx - 1, 0); x <= min(tx + 1, cur.tiles_x - 1); x++)
+                    active = active || cur.tile_infected[x + cur.tiles_x * y] > 0;
+
+            int x0 = tx * TILE + 1, x1 = min(x0 + TILE, cur.w + 1);
+            int y0 = ty * TILE + 1, y1 = min(y0 + TILE, cur.h + 1);
+            if (!active) {
+#ifdef _GLIBCXX_DEBUG
+                assert(next.tile_infected[tx + cur.tiles_x * ty] ==
+                       cur.tile_infected[tx + cur.tiles_x * ty]);
+                for (int i = y0; i < y1; i++)
+                    for (int j = x0; j < x1; j++) {
+                        assert(next.clean_prob[cur.idx(j, i)] ==
+                               cur.clean_prob[cur.idx(j, i)]);
+                        assert(next.inf_prob[cur.idx(j, i)] ==
+                               cur.inf_prob[cur.idx(j, i)]);
+                    }
+#endif
+                continue;
+            }
+
+            int &count = next.tile_infected[tx + cur.tiles_x * ty];
+            count = 0;
+            for (int i = y0; i < y1; i++) {
+                int row = cur.idx(0, i);
+                spread_row(cur.clean_prob.data(), cur.inf_prob.data(),
+                           cur.stride, ::spread_prob, row + x0, row + x1,
+                           next.clean_prob.data(), next.inf_prob.data());
+                for (int j = x0; j < x1; j++) {
+                    double inf = next.inf_prob[row + j];
+                    if (inf > ACTIVE_PROB)
+                        next.add_active(j, i);
+                    count += inf != 0.0;
+                }
+            }
         }
-    }
 }
 
 
 void check_model(const Model &prediction, const Model &reality) {
-    assert(prediction.size() == reality.size());
-    assert(prediction[0].size() == reality[0].size());
-    for (int i = 0; i < prediction.size(); i++) {
-        for (int j = 0; j < prediction[0].size(); j++) {
-            prediction[i][j].check(reality[i][j]);
+    assert(prediction.w == reality.w);
+    assert(prediction.h == reality.h);
+    for (int i = 0; i < prediction.h + 2; i++) {
+        for (int j = 0; j < prediction.stride; j++) {
+            prediction.get(j, i).check(reality.get(j, i));
         }
     }
 }
 
 
-void cure_model(const vector<vector<double>> &med, Model &model) {
-    assert(med.size() == model.size() - 2);
-    assert(med[0].size() == model[0].size() - 2);
-    for (int i = 0; i < med.size(); i++)
-        for (int j = 0; j < med[0].size(); j++)
-            if (med[i][j] >= 1.0) {
-                if (model[i + 1][j + 1].inf_prob >= 0.5) {
-                    // cerr << "CURED!!!!!!!!";
-                    // debug2(j, i);
-                }
-                model[i + 1][j + 1].cure();
-            }
+// Only tiles with some infection and possibly some medicine are looked
+// at, curing the rest would change nothing. Field is a MedField or a
+// DropField.
+template<typename Field>
+void cure_model(const Field &med, Model &model) {
+    assert(med.h == model.h);
+    assert(med.w == model.w);
+    for (int ty = 0; ty < model.tiles_y; ty++)
+        for (int tx = 0; tx < model.tiles_x; tx++) {
+            if (model.tile_infected[tx + model.tiles_x * ty] == 0 ||
+                !med.may_be_nonzero(tx, ty))
+                continue;
+            for (int i = ty * TILE; i < min((ty + 1) * TILE, med.h); i++)
+                for (int j = tx * TILE; j < min((tx + 1) * TILE, med.w); j++)
+                    if (med.at(j, i) >= 1.0) {
+                        // if (model.inf_prob[model.idx(j + 1, i + 1)] >= 0.5) {
+                        //     cerr << "CURED!!!!!!!!";
+                        //     debug2(j, i);
+                        // }
+                        model.inf_changed(
+                            j + 1, i + 1,
+                            model.inf_prob[model.idx(j + 1, i + 1)], 0.0);
+                        model.cure(j + 1, i + 1);
+                    }
+        }
 }
 
 
+// Set of cells (x + w * y, unpadded) with O(1) insert and clear.
+struct CellSet {
+    int w, h;
+    vector<int> cells;
+    vector<int> stamp;
+    int epoch;
+
+    CellSet(int w, int h) : w(w), h(h), stamp(w * h, 0), epoch(1) {}
+
+    void clear() {
+        cells.clear();
+        epoch++;
+    }
+
+    void insert(int c) {
+        if (stamp[c] != epoch) {
+            stamp[c] = epoch;
+            cells.push_back(c);
+        }
+    }
+
+    // Adds every cell within Manhattan distance r of the set.
+    void dilate(int r) {
+        int begin = 0;
+        for (int i = 0; i < r; i++) {
+            int end = cells.size();
+            for (int k = begin; k < end; k++) {
+                int c = cells[k];
+                int x = c % w;
+                int y = c / w;
+                if (x > 0) insert(c - 1);
+                if (x + 1 < w) insert(c + 1);
+                if (y > 0) insert(c - w);
+                if (y + 1 < h) insert(c + w);
+            }
+            begin = end;
+        }
+    }
+};
+
+
 struct CureFootprint {
     vector<PointSet> cured_sets;
     int x, y, t;
 
     bool empty() const {
         for (const auto &cs : cured_sets)
-            if (!cs.points.empty())
+            if (!cs.empty())
                 return false;
         return true;
     }
@@ -307,7 +905,7 @@ struct CureFootprint {
     int size() const {
         int result = 0;
         for (const auto &cs : cured_sets)
-            result += cs.points.size();
+            result += cs.size();
         return result;
     }
 
@@ -322,186 +920,816 @@ struct CureFootprint {
 };
 
 
+// Filters footprints down to the ones not dominated by another.
+// Candidates are visited in order of decreasing size and each is checked
+// only against accepted footprints whose drop is within 2M (Manhattan):
+// otherwise no cell is in reach of both drops, so neither can contain
+// the other. Accepted drops are bucketed on a grid of (2M + 1)-cells.
+vector<CureFootprint> pareto_frontier(const vector<CureFootprint> &candidates) {
+    PERF_SCOPE(pareto);
+    const int cell = 2*::horizon + 1;
+    int bw = (::w + cell - 1) / cell;
+    int bh = (::h + cell - 1) / cell;
+    vector<vector<int>> buckets(bw * bh);
+
+    vector<int> sizes;
+    sizes.reserve(candidates.size());
+    for (const auto &cfp : candidates)
+        sizes.push_back(cfp.size());
+
+    vector<int> order(candidates.size());
+    for (int i = 0; i < order.size(); i++)
+        order[i] = i;
+    // Same comparisons as sorting the footprints themselves, so the
+    // resulting order (and the frontier) is the same as it used to be.
+    sort(order.begin(), order.end(),
+        [&sizes](int a, int b) {
+            return sizes[a] > sizes[b];
+        });
+
+    // TODO: among equivalent items, pick ones that go ahead of the
+    // frontier as much as possible.
+    vector<CureFootprint> frontier;
+    for (int i : order) {
+        const auto &cfp = candidates[i];
+        int bx = cfp.x / cell;
+        int by = cfp.y / cell;
+        bool to_add = true;
+        for (int y = max(by - 1, 0); to_add && y <= min(by + 1, bh - 1); y++) {
+            for (int x = max(bx - 1, 0); to_add && x <= min(bx + 1, bw - 1); x++) {
+                for (int j : buckets[x + bw * y]) {
+                    const auto &d = candidates[j];
+                    if (sizes[j] < sizes[i])
+                        continue;
+                    if (abs(d.x - cfp.x) + abs(d.y - cfp.y) > 2*::horizon)
+                        continue;
+                    if (d.dominates(cfp)) {
+                        to_add = false;
+                        break;
+                    }
+                }
+            }
+        }
+        if (to_add) {
+            buckets[bx + bw * by].push_back(i);
+            frontier.push_back(cfp);
+        }
+    }
+    return frontier;
+}
+
+
 typedef map<pair<int, int>, double> Improvement;
 
-double improvement_sum(const Improvement &imp) {
-    double result = 0.0;
-    for (const auto &kv : imp)
-        result += kv.second;
-    return result;
-}
 
-void improvement_merge_with(Improvement &imp, const Improvement &other) {
-    for (const auto &kv : other) {
-        double &q = imp[kv.first];
-        q = max(q, kv.second);
+struct Modeller;
+
+// make_cure_footprint() for one horizon, see MAX_M.
+class FootprintKernel {
+public:
+    virtual ~FootprintKernel() {}
+    virtual CureFootprint make(
+        const Modeller &modeller, int x0, int y0, int t0) const = 0;
+    // Diffusion<M>::reach() of the kernel's M, walls included.
+    virtual double reach(int x1, int y1, int x2, int y2, int dt) const = 0;
+};
+
+unique_ptr<FootprintKernel> footprint_kernel;
+
+// FootprintKernel for horizon M; make() is defined after Modeller.
+template<int M>
+class FootprintKernelFor : public FootprintKernel {
+public:
+    FootprintKernelFor(int w, int h, int med_strength)
+        : diffusion(w, h, med_strength) {}
+
+    double reach(int x1, int y1, int x2, int y2, int dt) const {
+        return diffusion.reach(x1, y1, x2, y2, dt);
     }
+
+    CureFootprint make(
+        const Modeller &modeller, int x0, int y0, int t0) const;
+
+private:
+    Diffusion<M> diffusion;
+};
+
+// Horizons with a kernel compiled in, indexed by M.
+unique_ptr<FootprintKernel> make_footprint_kernel(
+        int horizon, int w, int h, int med_strength) {
+    typedef FootprintKernel *(*Factory)(int, int, int);
+    static const Factory table[MAX_M + 1] = {
+        nullptr, nullptr, nullptr,
+        [](int w, int h, int s) -> FootprintKernel * {
+            return new FootprintKernelFor<3>(w, h, s); },
+        [](int w, int h, int s) -> FootprintKernel * {
+            return new FootprintKernelFor<4>(w, h, s); },
+        [](int w, int h, int s) -> FootprintKernel * {
+            return new FootprintKernelFor<5>(w, h, s); },
+        [](int w, int h, int s) -> FootprintKernel * {
+            return new FootprintKernelFor<6>(w, h, s); },
+        [](int w, int h, int s) -> FootprintKernel * {
+            return new FootprintKernelFor<7>(w, h, s); },
+    };
+    assert(horizon >= 0 && horizon <= MAX_M && table[horizon] != nullptr);
+    return unique_ptr<FootprintKernel>(table[horizon](w, h, med_strength));
 }
 
 
+// Medicine as the sum of a dense field and the drops of the last horizon
+// ticks, each evaluated from the tabulated kernel: drops are kept as
+// points until they are horizon ticks old and only then folded into the
+// dense part, which is stepped as usual. By linearity of the diffusion
+// this is the same field as stepping everything, up to rounding. Until
+// drops get old, the dense part is zero and its stepping skips every tile.
+class DropField {
+public:
+    struct Drop {
+        int x, y;
+        int age;
+    };
+
+    int w, h;
+    MedField base;
+    vector<Drop> drops;
+
+    DropField(int w, int h) : w(w), h(h), base(w, h), spare(w, h) {}
+
+    void add(int x, int y) {
+        drops.push_back({x, y, 0});
+    }
+
+    // Advances one tick.
+    void step() {
+        int k = 0;
+        for (const auto &d : drops)
+            if (d.age < ::horizon)
+                drops[k++] = d;
+            else
+                fold(d);
+        drops.resize(k);
+        diffusion_step(base, spare);
+        swap(base, spare);
+        for (auto &d : drops)
+            d.age++;
+    }
+
+    double at(int x, int y) const {
+        double result = base.at(x, y);
+        int m = ::horizon;
+        for (const auto &d : drops)
+            if (abs(x - d.x) <= m && abs(y - d.y) <= m)
+                result += ::footprint_kernel->reach(x, y, d.x, d.y, d.age);
+        return result;
+    }
+
+    // Whether tile (tx, ty) may hold a nonzero value, as in MedField.
+    bool may_be_nonzero(int tx, int ty) const {
+        if (base.may_be_nonzero(tx, ty))
+            return true;
+        int m = ::horizon;
+        for (const auto &d : drops)
+            if (d.x + m >= tx * TILE && d.x - m < (tx + 1) * TILE &&
+                d.y + m >= ty * TILE && d.y - m < (ty + 1) * TILE)
+                return true;
+        return false;
+    }
+
+private:
+    void fold(const Drop &d) {
+        int m = ::horizon;
+        for (int y = max(d.y - m, 0); y <= min(d.y + m, h - 1); y++)
+            for (int x = max(d.x - m, 0); x <= min(d.x + m, w - 1); x++) {
+                double v = ::footprint_kernel->reach(x, y, d.x, d.y, d.age);
+                if (v != 0.0)
+                    base.at(x, y) += v;
+            }
+    }
+
+    MedField spare;
+};
+
+
 struct Modeller {
     vector<bool> phases;
-    vector<vector<vector<double>>> med_prediction;
+    vector<MedField> med_prediction;
     vector<Model> model_prediction;
 
+    // Compact storage, so that memory per tick grows with the region near
+    // infection rather than the whole slide. med_prediction is left empty
+    // and tick t's medicine is kept in med_windows[t], only over the
+    // infected tiles of its epoch as of the epoch's start (cures only
+    // shrink that set). Medicine is only ever read where there may be
+    // infection, so nothing else is needed.
+    //
+    // model_prediction keeps only epoch 0, and epoch e > 0 is kept in
+    // model_windows[e], over the infected tiles of epoch e - 1 grown by one
+    // tile. update_model() leaves the rest bit-identical to epoch e - 1,
+    // and cures only touch infected tiles, which are all in there, so
+    // outside of it epoch e is epoch e - 1 (and has no infection). Reads
+    // go through distr_at() and inf_at().
+    //
+    // While building, at most three full Models and two full MedFields
+    // are alive. Compact Modellers neither reuse a previous one nor can
+    // be reused.
+    bool compact;
+    vector<MedWindow> med_windows;
+    vector<ModelWindow> model_windows;
+    // window_of[e * tiles + tile]: the last epoch up to e whose window
+    // covers the tile, or 0. Windows are whole tiles of the unpadded grid
+    // (clipped to it), so for unpadded cells that is where epoch e is.
+    vector<int> window_of;
+    // While building: the medicine window of the current epoch.
+    int med_box_x1, med_box_y1, med_box_x2, med_box_y2;
+    // When built from a DropField: live_drops[t] are its drops that are
+    // at most horizon ticks old at tick t, with their age then. They are
+    // not in med_windows[t] and are added on every read. Empty past the
+    // last tick with any.
+    vector<vector<DropField::Drop>> live_drops;
+
+    // Everything simulate() needs to modify, one per worker, so calls from
+    // different workers can run concurrently. It works on a private copy of
+    // the prediction (made on first use) and undoes its changes before
+    // returning. Cell sets are flat lists deduplicated by epoch stamps,
+    // so after warm-up a call allocates nothing but its result.
+    struct Scratch {
+        struct Undo {
+            int q;
+            int idx;
+            Distr old;
+        };
+
+        // Copies of model_prediction and model_windows. With compact
+        // storage, cells written outside of their epoch's window go to
+        // outside[q], allocated on first use and valid where its stamp is
+        // outside_epoch; changes are contained in the windows, so normally
+        // there are none.
+        struct Outside {
+            vector<int> stamp;
+            vector<double> clean_prob, inf_prob;
+        };
+        vector<Model> model_prediction;
+        vector<ModelWindow> model_windows;
+        vector<Outside> outside;
+        int outside_epoch;
+        int stride;
+        vector<int> cured_stamp, update_stamp, changed_stamp;
+        int epoch;
+        vector<int> cured, to_update, changed, next_changed;
+        vector<Undo> undo;
+        vector<pair<pair<int, int>, double>> gains;
+
+        void init(const Modeller &modeller) {
+            if (!model_prediction.empty())
+                return;
+            model_prediction = modeller.model_prediction;
+            model_windows = modeller.model_windows;
+            outside.resize(model_windows.size());
+            outside_epoch = 1;
+            stride = model_prediction[0].stride;
+            int n = model_prediction[0].clean_prob.size();
+            cured_stamp.assign(n, 0);
+            update_stamp.assign(n, 0);
+            changed_stamp.assign(n, 0);
+            epoch = 0;
+        }
+
+        // Padded cell (x, y) in the copy of epoch q.
+        Distr get(const Modeller &modeller, int q, int x, int y) const {
+            int i = x + stride * y;
+            if (!modeller.compact || q == 0) {
+                const Model &model = model_prediction[q];
+                return Distr(model.clean_prob[i], model.inf_prob[i]);
+            }
+            const ModelWindow &win = model_windows[q];
+            if (win.contains(x, y)) {
+                int k = win.idx(x, y);
+                return Distr(win.clean_prob[k], win.inf_prob[k]);
+            }
+            const Outside &o = outside[q];
+            if (!o.stamp.empty() && o.stamp[i] == outside_epoch) {
+                // Not through the constructor: after a cure, clean_prob
+                // can round to just above 1.
+                Distr d = Distr::dead();
+                d.clean_prob = o.clean_prob[i];
+                d.inf_prob = o.inf_prob[i];
+                return d;
+            }
+            return modeller.distr_at(q - 1, x, y);
+        }
+
+        void set(const Modeller &modeller, int q, int x, int y,
+                 double clean_prob, double inf_prob) {
+            int i = x + stride * y;
+            if (!modeller.compact || q == 0) {
+                Model &model = model_prediction[q];
+                model.clean_prob[i] = clean_prob;
+                model.inf_prob[i] = inf_prob;
+                return;
+            }
+            ModelWindow &win = model_windows[q];
+            if (win.contains(x, y)) {
+                int k = win.idx(x, y);
+                win.clean_prob[k] = clean_prob;
+                win.inf_prob[k] = inf_prob;
+                return;
+            }
+            Outside &o = outside[q];
+            if (o.stamp.empty()) {
+                int n = model_prediction[0].clean_prob.size();
+                o.stamp.assign(n, 0);
+                o.clean_prob.resize(n);
+                o.inf_prob.resize(n);
+            }
+            o.stamp[i] = outside_epoch;
+            o.clean_prob[i] = clean_prob;
+            o.inf_prob[i] = inf_prob;
+        }
+
+        // Forgets all writes outside of the windows.
+        void clear_outside() {
+            if (outside_epoch == INT_MAX) {
+                for (auto &o : outside)
+                    fill(o.stamp.begin(), o.stamp.end(), 0);
+                outside_epoch = 0;
+            }
+            outside_epoch++;
+        }
+
+        int next_epoch() {
+            if (epoch == INT_MAX) {
+                fill(cured_stamp.begin(), cured_stamp.end(), 0);
+                fill(update_stamp.begin(), update_stamp.end(), 0);
+                fill(changed_stamp.begin(), changed_stamp.end(), 0);
+                epoch = 0;
+            }
+            return ++epoch;
+        }
+    };
+    mutable vector<Scratch> scratches;
+
+    // If prev is given, it must be a prediction that started `shift` ticks
+    // earlier (its tick t + shift is our tick t). Wherever the starting
+    // state and medicine agree with it, so do all later ticks, so the
+    // overlapping part is copied from prev and only cells that the
+    // differences can reach are recomputed. The result is bit-identical to
+    // building from scratch.
     Modeller(
-        vector<vector<double>> med, Model model, vector<bool> phases)
+        MedField med, Model model, vector<bool> phases, int num_workers = 1,
+        const Modeller *prev = nullptr, int shift = 0, bool compact = false)
         : phases(phases),
           med_prediction({med}),
-          model_prediction({model}) {
-
-        for (bool phase : phases) {
-            // cure
-            cure_model(med_prediction.back(), model_prediction.back());
-
-            if (phase) {
-                // spread
-                model_prediction.push_back(model_prediction.back());
-                update_model(
-                    model_prediction[model_prediction.size() - 2],
-                    model_prediction[model_prediction.size() - 1]);
+          model_prediction({model}),
+          compact(compact),
+          scratches(num_workers) {
+        med_prediction.reserve(phases.size() + 1);
+        start_prediction();
+
+        bool reuse = !compact && prev != nullptr && !prev->compact &&
+                     shift >= 0 && shift < prev->phases.size();
+        int prev_epoch = 0;
+        CellSet med_dirty(med.w, med.h), region(med.w, med.h);
+        if (reuse) {
+            prev_epoch = count(
+                prev->phases.begin(), prev->phases.begin() + shift, true);
+            const MedField &other = prev->med_prediction[shift];
+            for (int c = 0; c < med.w * med.h; c++)
+                if (med.values[c] != other.values[c])
+                    med_dirty.insert(c);
+        }
+        int recomputed = 0;
+
+        for (int t = 0; t < phases.size(); t++) {
+            bool covered = reuse && t + shift < prev->phases.size();
+
+            predict_tick(t, med_prediction.back(), !covered);
+
+            if (phases[t] && covered) {
+                // spread, reusing prev outside of cells whose neighborhood
+                // differs now or whose medicine may differ before the next
+                // spread. Cures are idempotent, so the ones prev already
+                // applied later in the epoch do no harm.
+                int k = model_prediction.size() - 1 + prev_epoch;
+                const Model &cur = model_prediction.back();
+                const Model &other = prev->model_prediction[k];
+                int epoch_length = 1;
+                while (t + epoch_length < phases.size() &&
+                       !phases[t + epoch_length])
+                    epoch_length++;
+                region.clear();
+                for (int c : med_dirty.cells)
+                    region.insert(c);
+                region.dilate(epoch_length);
+                for (int y = 0; y < cur.h; y++)
+                    for (int x = 0; x < cur.w; x++) {
+                        int i = cur.idx(x + 1, y + 1);
+                        if (cur.clean_prob[i] != other.clean_prob[i] ||
+                            cur.inf_prob[i] != other.inf_prob[i])
+                            region.insert(x + cur.w * y);
+                    }
+                region.dilate(1);
+
+                model_prediction.push_back(prev->model_prediction[k + 1]);
+                const Model &from = model_prediction[model_prediction.size() - 2];
+                Model &to = model_prediction.back();
+                for (int c : region.cells) {
+                    int i = from.idx(c % from.w + 1, c / from.w + 1);
+                    double before = to.inf_prob[i];
+                    spread_row(from.clean_prob.data(), from.inf_prob.data(),
+                               from.stride, ::spread_prob, i, i + 1,
+                               to.clean_prob.data(), to.inf_prob.data());
+                    to.inf_changed(c % from.w + 1, c / from.w + 1,
+                                   before, to.inf_prob[i]);
+                }
+                recomputed += region.cells.size();
             }
 
             // diffuse
-            med_prediction.push_back(med_prediction.back());
-            diffusion_step(
-                med_prediction[med_prediction.size() - 2],
-                med_prediction[med_prediction.size() - 1]);
+            if (covered) {
+                med_prediction.push_back(prev->med_prediction[t + shift + 1]);
+                const MedField &cur = med_prediction[med_prediction.size() - 2];
+                MedField &next = med_prediction.back();
+                med_dirty.dilate(1);
+                vector<int> dirty;
+                dirty.swap(med_dirty.cells);
+                med_dirty.clear();
+                for (int c : dirty) {
+                    int x = c % cur.w;
+                    int y = c / cur.w;
+                    const double *p = cur.values.data() + c;
+                    next.values[c] = diffuse_cell(
+                        p[0],
+                        x > 0 ? p[-1] : p[0],
+                        y > 0 ? p[-cur.w] : p[0],
+                        x + 1 < cur.w ? p[1] : p[0],
+                        y + 1 < cur.h ? p[cur.w] : p[0]);
+                    if (next.values[c] != 0.0)
+                        next.mark(x, y);
+                    if (next.values[c] !=
+                        prev->med_prediction[t + shift + 1].values[c])
+                        med_dirty.insert(c);
+                }
+                recomputed += dirty.size();
+            } else {
+                med_prediction.emplace_back(med.w, med.h);
+                diffusion_step(
+                    med_prediction[med_prediction.size() - 2],
+                    med_prediction[med_prediction.size() - 1]);
+            }
+
+            // Only its window is kept.
+            if (compact)
+                vector<double>().swap(med_prediction[t].values);
         }
+        if (reuse)
+            debug2(shift, recomputed);
+        finish_prediction();
 
         // TODO: cure as well
     }
 
-    CureFootprint make_cure_footprint(int x0, int y0, int t0) const {
-        CureFootprint result;
-        result.x = x0;
-        result.y = y0;
-        result.t = t0;
-        result.cured_sets.resize(model_prediction.size());
-
-        assert(t0 <= phases.size());
-        int start_model_idx = count(phases.begin(), phases.begin() + t0, true);
-
-        for (int y = max(0, y0 - M); y < ::h && y <= y0 + M; y++) {
-            for (int x = max(0, x0 - M); x < ::w && x <= x0 + M; x++) {
-                if (abs(x - x0) + abs(y - y0) > M)
+    // Built from the drop representation of the medicine: compact, with
+    // medicine reads summed from med_windows and the drops in the same
+    // order as DropField::at(). Not bit-identical to stepping the dense
+    // field, so cures right at the threshold can come out differently.
+    Modeller(const DropField &med, Model model, vector<bool> phases,
+             int num_workers = 1)
+        : phases(phases),
+          model_prediction({model}),
+          compact(true),
+          scratches(num_workers) {
+        for (int t = 0; t < phases.size(); t++) {
+            vector<DropField::Drop> live;
+            for (auto d : med.drops)
+                if (d.age + t <= ::horizon) {
+                    d.age += t;
+                    live.push_back(d);
+                }
+            if (live.empty())
+                break;
+            live_drops.push_back(move(live));
+        }
+        start_prediction();
+        DropField cur = med;
+        for (int t = 0; t < phases.size(); t++) {
+            predict_tick(t, cur, true);
+
+            // diffuse
+            cur.step();
+        }
+        finish_prediction();
+    }
+
+    // The constructors' shared part; they differ in how the medicine is
+    // stepped and in reuse.
+    void start_prediction() {
+        med_box_x1 = med_box_y1 = med_box_x2 = med_box_y2 = 0;
+        model_prediction.reserve(phases.size() + 1);
+        if (compact) {
+            med_windows.reserve(phases.size());
+            // Epoch 0 is kept whole.
+            model_windows.emplace_back(0, 0, 0, 0);
+        }
+    }
+
+    // Tick t up to diffusion, with med (a MedField or a DropField) the
+    // medicine at tick t: cures, spreads if it is a spread tick (unless
+    // the caller does that itself) and with compact storage keeps the
+    // medicine window.
+    template<typename Field>
+    void predict_tick(int t, const Field &med, bool spread) {
+        if (compact && (t == 0 || phases[t - 1]))
+            model_prediction.back().infected_box(
+                med_box_x1, med_box_y1, med_box_x2, med_box_y2);
+
+        // cure
+        cure_model(med, model_prediction.back());
+
+        // spread
+        if (phases[t] && spread) {
+            model_prediction.push_back(model_prediction.back());
+            update_model(
+                model_prediction[model_prediction.size() - 2],
+                model_prediction[model_prediction.size() - 1]);
+            if (compact) {
+                int e = model_prediction.size() - 2;
+                model_windows.push_back(spread_window(model_prediction[e]));
+                close_epoch(e);
+            }
+        }
+
+        if (compact)
+            med_windows.emplace_back(dense_part(med), med_box_x1, med_box_y1,
+                                     med_box_x2, med_box_y2);
+    }
+
+    static const MedField &dense_part(const MedField &med) {
+        return med;
+    }
+
+    static const MedField &dense_part(const DropField &med) {
+        return med.base;
+    }
+
+    void finish_prediction() {
+        if (compact) {
+            med_prediction.clear();
+            close_epoch(model_prediction.size() - 1);
+            model_prediction.resize(1);
+
+            const Model &model = model_prediction[0];
+            int tiles = model.tiles_x * model.tiles_y;
+            window_of.assign(model_windows.size() * tiles, 0);
+            for (int e = 1; e < model_windows.size(); e++) {
+                copy(window_of.begin() + (e - 1) * tiles,
+                     window_of.begin() + e * tiles,
+                     window_of.begin() + e * tiles);
+                const ModelWindow &win = model_windows[e];
+                if (win.x1 == win.x2 || win.y1 == win.y2)
                     continue;
-                // TODO: precompute start value of model_idx,
-                // and iterate from t0
-                int model_idx = start_model_idx;
-                for (int t = t0; t < phases.size() && t <= t0 + M; t++) {
-                    // cure
-                    const auto &model = model_prediction[model_idx];
-                    if (model[y + 1][x + 1].inf_prob > 1e-6) {
-                        if (::diffusion.reach(x, y, x0, y0, t - t0) +
-                            0.99 * med_prediction[t][y][x] >= 1.0) {
-                            result.cured_sets[model_idx].add_point(x, y);
-                        }
-                    }
+                for (int y = win.y1; y < win.y2; y += TILE)
+                    for (int x = win.x1; x < win.x2; x += TILE)
+                        window_of[e * tiles + model.tile(x, y)] = e;
+            }
+        }
+#ifdef PERF_STATS
+        for (const auto &m : med_prediction)
+            PERF_COUNT(med_cells, m.values.size());
+        for (const auto &m : med_windows)
+            PERF_COUNT(med_cells, m.values.size());
+        for (const auto &m : model_prediction)
+            PERF_COUNT(model_cells, m.clean_prob.size());
+        for (const auto &m : model_windows)
+            PERF_COUNT(model_cells, m.clean_prob.size());
+#endif
+    }
+
+    // Compact storage: window of the epoch spread from model, see
+    // model_windows.
+    static ModelWindow spread_window(const Model &model) {
+        int x1, y1, x2, y2;
+        model.infected_box(x1, y1, x2, y2);
+        if (x1 == x2)
+            return ModelWindow(0, 0, 0, 0);
+        return ModelWindow(
+            max(x1 - TILE, 0) + 1, max(y1 - TILE, 0) + 1,
+            min(x2 + TILE, model.w) + 1, min(y2 + TILE, model.h) + 1);
+    }
 
-                    // spread
-                    if (phases[t])
-                        model_idx++;
+    // Compact storage: epoch e of model_prediction is final, so unless it
+    // is epoch 0, it moves to its window.
+    void close_epoch(int e) {
+        if (e == 0)
+            return;
+        model_windows[e].copy_from(model_prediction[e]);
+        model_prediction[e] = Model();
+    }
 
-                    // diffuse (implicitly in loop increment)
-                }
-                // TODO: cure as well
+    int num_epochs() const {
+        return compact ? model_windows.size() : model_prediction.size();
+    }
+
+    // Padded cell (x, y) in epoch e.
+    Distr distr_at(int e, int x, int y) const {
+        if (!compact)
+            return model_prediction[e].get(x, y);
+        // The padding is in no window.
+        const Model &model = model_prediction[0];
+        if (e > 0 && x >= 1 && x <= model.w && y >= 1 && y <= model.h) {
+            int q = window_of[
+                e * model.tiles_x * model.tiles_y + model.tile(x, y)];
+            if (q > 0) {
+                const ModelWindow &win = model_windows[q];
+                int k = win.idx(x, y);
+                return Distr(win.clean_prob[k], win.inf_prob[k]);
             }
         }
+        return model.get(x, y);
+    }
 
-        return result;
+    double inf_at(int e, int x, int y) const {
+        if (!compact || e == 0) {
+            const Model &model = model_prediction[e];
+            return model.inf_prob[model.idx(x, y)];
+        }
+        const ModelWindow &win = model_windows[e];
+        return win.contains(x, y) ? win.inf_prob[win.idx(x, y)] : 0.0;
     }
 
-    Improvement simulate(const vector<CureFootprint> &footprints) {
-        Improvement improvement;
+    // Active cell count and box (padded, inclusive) of epoch e, as in
+    // Model.
+    void active_box(int e, int &num_active,
+                    int &x1, int &y1, int &x2, int &y2) const {
+        if (!compact || e == 0) {
+            const Model &model = model_prediction[e];
+            num_active = model.num_active;
+            x1 = model.active_x1, y1 = model.active_y1;
+            x2 = model.active_x2, y2 = model.active_y2;
+        } else {
+            const ModelWindow &win = model_windows[e];
+            num_active = win.num_active;
+            x1 = win.active_x1, y1 = win.active_y1;
+            x2 = win.active_x2, y2 = win.active_y2;
+        }
+    }
 
-        set<pair<int, int>> changed;
+    // Medicine at (x, y) during tick t. With compact storage, only where
+    // the tick's epoch may have infection.
+    double med_at(int t, int x, int y) const {
+        return med_at(t, x, y, *::footprint_kernel);
+    }
 
-        vector<pair<Distr*, Distr>> old_values;
+    // The same with drops evaluated by kernel.reach(), for a kernel that
+    // agrees with ::footprint_kernel, so that callers that know its type
+    // avoid the virtual calls.
+    template<typename Kernel>
+    double med_at(int t, int x, int y, const Kernel &kernel) const {
+        if (!compact)
+            return med_prediction[t].at(x, y);
+        double result = med_windows[t].at(x, y);
+        if (t < live_drops.size()) {
+            int m = ::horizon;
+            for (const auto &d : live_drops[t])
+                if (abs(x - d.x) <= m && abs(y - d.y) <= m)
+                    result += kernel.reach(x, y, d.x, d.y, d.age);
+        }
+        return result;
+    }
 
-        for (int q = 0; q < model_prediction.size(); q++) {
-            bool last = q + 1 == model_prediction.size();
+    CureFootprint make_cure_footprint(int x0, int y0, int t0) const {
+        return ::footprint_kernel->make(*this, x0, y0, t0);
+    }
 
-            set<pair<int, int>> all_cured_points;
+    Improvement simulate(
+            const vector<CureFootprint> &footprints, int worker = 0) const {
+        PERF_SCOPE(simulate);
+        assert(worker >= 0 && worker < scratches.size());
+        auto &scratch = scratches[worker];
+        scratch.init(*this);
+
+        auto &cured = scratch.cured;
+        auto &to_update = scratch.to_update;
+        auto &changed = scratch.changed;
+        auto &next_changed = scratch.next_changed;
+        auto &undo = scratch.undo;
+        auto &gains = scratch.gains;
+        changed.clear();
+        undo.clear();
+        gains.clear();
+
+        int stride = scratch.stride;
+        int num_epochs = this->num_epochs();
+
+        for (int q = 0; q < num_epochs; q++) {
+            bool last = q + 1 == num_epochs;
+
+            int cured_epoch = scratch.next_epoch();
+            cured.clear();
             for (const auto &f : footprints) {
-                for (const auto &pt : f.cured_sets[q].points) {
-                    int x = pt.first + 1;
-                    int y = pt.second + 1;
-                    all_cured_points.emplace(x, y);
-                }
+                f.cured_sets[q].for_each_point([&](int x, int y) {
+                    int i = x + 1 + stride * (y + 1);
+                    if (scratch.cured_stamp[i] != cured_epoch) {
+                        scratch.cured_stamp[i] = cured_epoch;
+                        cured.push_back(i);
+                    }
+                });
             }
 
-            set<pair<int, int>> neighbors_to_update;
-            for (const auto &pt : changed) {
-                int x = pt.first;
-                int y = pt.second;
+            int update_epoch = scratch.next_epoch();
+            to_update.clear();
+            auto add_to_update = [&](int i) {
+                if (scratch.update_stamp[i] != update_epoch) {
+                    scratch.update_stamp[i] = update_epoch;
+                    to_update.push_back(i);
+                }
+            };
+            for (int i : changed) {
+                int x = i % stride;
+                int y = i / stride;
                 if (x - 1 > 0)
-                    neighbors_to_update.emplace(x - 1, y);
+                    add_to_update(i - 1);
                 if (x + 1 <= ::w)
-                    neighbors_to_update.emplace(x + 1, y);
+                    add_to_update(i + 1);
                 if (y - 1 > 0)
-                    neighbors_to_update.emplace(x, y - 1);
+                    add_to_update(i - stride);
                 if (y + 1 <= ::h)
-                    neighbors_to_update.emplace(x, y + 1);
+                    add_to_update(i + stride);
             }
-            changed.clear();
-            for (const auto &pt : neighbors_to_update) {
-                int x = pt.first;
-                int y = pt.second;
 
-                const auto &prev_model = model_prediction[q - 1];
-                auto &model = model_prediction[q];
+            int changed_epoch = scratch.next_epoch();
+            next_changed.clear();
+            auto mark_changed = [&](int i) {
+                if (scratch.changed_stamp[i] != changed_epoch) {
+                    scratch.changed_stamp[i] = changed_epoch;
+                    next_changed.push_back(i);
+                }
+            };
+
+            for (int i : to_update) {
+                int x = i % stride;
+                int y = i / stride;
 
-                auto new_distr = all_cured_points.count(pt) > 0
+                auto new_distr = scratch.cured_stamp[i] == cured_epoch
                     ? Distr::clean()
-                    : prev_model[y][x].step(
-                        prev_model[y - 1][x],
-                        prev_model[y + 1][x],
-                        prev_model[y][x - 1],
-                        prev_model[y][x + 1]);
+                    : scratch.get(*this, q - 1, x, y).step(
+                        scratch.get(*this, q - 1, x, y - 1),
+                        scratch.get(*this, q - 1, x, y + 1),
+                        scratch.get(*this, q - 1, x - 1, y),
+                        scratch.get(*this, q - 1, x + 1, y));
 
-                if (new_distr.dist(model[y][x]) > 1e-6) {
-                    double delta = new_distr.clean_prob - model[y][x].clean_prob;
+                auto old_distr = scratch.get(*this, q, x, y);
+                if (new_distr.dist(old_distr) > 1e-6) {
+                    double delta = new_distr.clean_prob - old_distr.clean_prob;
 
                     // TODO: this assertion fails, why?
                     // assert(delta >= -1e-6);
 
-                    if (last && delta > 1e-3) {
-                        assert(improvement.count(pt) == 0);
-                        improvement[pt] = delta;
-                    }
+                    if (last && delta > 1e-3)
+                        gains.emplace_back(make_pair(x, y), delta);
 
-                    old_values.emplace_back(&model[y][x], model[y][x]);
-                    model[y][x] = new_distr;
-                    changed.insert(pt);
+                    undo.push_back({q, i, old_distr});
+                    scratch.set(*this, q, x, y,
+                                new_distr.clean_prob, new_distr.inf_prob);
+                    mark_changed(i);
                 }
             }
 
             // TODO: change should only be considered change after
             // spread step together with cure step.
 
-            for (auto pt : all_cured_points) {
-                int x = pt.first;
-                int y = pt.second;
-                auto &distr = model_prediction[q][y][x];
-                // Some points can be visited second time, but then condition
-                // will be false, so we won't update them twice.
+            for (int i : cured) {
+                int x = i % stride;
+                int y = i / stride;
+                auto distr = scratch.get(*this, q, x, y);
                 if (distr.inf_prob > 1e-6) {
-                    if (last && distr.inf_prob > 1e-3) {
-                        assert(improvement.count(pt) == 0);
-                        improvement[pt] = distr.inf_prob;
-                    }
+                    if (last && distr.inf_prob > 1e-3)
+                        gains.emplace_back(make_pair(x, y), distr.inf_prob);
 
-                    old_values.emplace_back(&distr, distr);
-                    distr.cure();
-                    changed.insert(pt);
+                    undo.push_back({q, i, distr});
+                    scratch.set(*this, q, x, y,
+                                distr.clean_prob + distr.inf_prob, 0.0);
+                    mark_changed(i);
                 }
             }
+
+            swap(changed, next_changed);
         }
 
-        reverse(old_values.begin(), old_values.end());
-        for (auto kv : old_values) {
-            *kv.first = kv.second;
+        for (int k = undo.size() - 1; k >= 0; k--) {
+            const auto &u = undo[k];
+            scratch.set(*this, u.q, u.idx % stride, u.idx / stride,
+                        u.old.clean_prob, u.old.inf_prob);
+        }
+        scratch.clear_outside();
+
+        // A cell gets at most one gain: once cured it is not updated again
+        // in the same step.
+        sort(gains.begin(), gains.end());
+        Improvement improvement;
+        for (int k = 0; k < gains.size(); k++) {
+            assert(k == 0 || gains[k - 1].first != gains[k].first);
+            improvement.emplace_hint(
+                improvement.end(), gains[k].first, gains[k].second);
         }
 
         // TODO: assert that model_prediction did not change
@@ -510,75 +1738,818 @@ struct Modeller {
 };
 
 
+template<int M>
+CureFootprint FootprintKernelFor<M>::make(
+        const Modeller &modeller, int x0, int y0, int t0) const {
+    PERF_SCOPE(footprint);
+    CureFootprint result;
+    result.x = x0;
+    result.y = y0;
+    result.t = t0;
+    result.cured_sets.assign(modeller.num_epochs(), PointSet(x0, y0));
+
+    assert(t0 <= modeller.phases.size());
+    int start_model_idx = count(modeller.phases.begin(), modeller.phases.begin() + t0, true);
+
+    for (int y = max(0, y0 - M); y < ::h && y <= y0 + M; y++) {
+        for (int x = max(0, x0 - M); x < ::w && x <= x0 + M; x++) {
+            if (abs(x - x0) + abs(y - y0) > M)
+                continue;
+            // TODO: precompute start value of model_idx,
+            // and iterate from t0
+            int model_idx = start_model_idx;
+            for (int t = t0; t < modeller.phases.size() && t <= t0 + M; t++) {
+                // cure
+                if (modeller.inf_at(model_idx, x + 1, y + 1) > 1e-6) {
+                    if (diffusion.reach(x, y, x0, y0, t - t0) +
+                        0.99 * modeller.med_at(t, x, y, diffusion) >= 1.0) {
+                        result.cured_sets[model_idx].add_point(x, y);
+                    }
+                }
+
+                // spread
+                if (modeller.phases[t])
+                    model_idx++;
+
+                // diffuse (implicitly in loop increment)
+            }
+            // TODO: cure as well
+        }
+    }
+
+    return result;
+}
+
+
+// Sampled alternative to Modeller::simulate(). Each cell holds bit planes
+// for 64 * words futures (bit k of a word is one future): inf and dead,
+// clean being neither. Every infection in the tester is created at a
+// spread tick and dies kill_time ticks later, so countdowns are the same
+// everywhere and whole epochs are stepped at once: everything infected
+// dies, and each clean cell catches it from each infected neighbor with
+// probability spread_prob. Unlike Distr this keeps neighboring cells
+// correlated.
+//
+// Random bits come from a counter-based generator keyed by (epoch, cell,
+// direction), so runs with and without a footprint see the same coin
+// flips (common random numbers) and differ only where the footprint
+// actually changes something.
+class MonteCarlo {
+public:
+    MonteCarlo(const Modeller &modeller, int words, uint64_t seed,
+               int num_workers = 1)
+        : words(words), seed(seed), spread_prob(::spread_prob),
+          stride(::w + 2), num_cells(stride * (::h + 2)),
+          num_epochs(modeller.num_epochs()),
+          inf(num_epochs), dead(num_epochs),
+          med_cured(num_epochs, vector<char>(num_cells, 0)),
+          scratches(num_workers) {
+        assert(words >= 1);
+        int e = 0;
+        for (int t = 0; t < modeller.phases.size(); t++) {
+            // Compact storage only has medicine where the epoch may have
+            // infection, which is also the only place samples can have it.
+            int x1 = 0, y1 = 0, x2 = ::w, y2 = ::h;
+            if (modeller.compact) {
+                const auto &win = modeller.med_windows[t];
+                x1 = win.x1, y1 = win.y1, x2 = win.x2, y2 = win.y2;
+            }
+            for (int y = y1; y < y2; y++)
+                for (int x = x1; x < x2; x++)
+                    if (modeller.med_at(t, x, y) >= 1.0)
+                        med_cured[e][x + 1 + stride * (y + 1)] = 1;
+            if (modeller.phases[t])
+                e++;
+        }
+        assert(e + 1 == num_epochs);
+
+        // Epoch 0 is sampled from the prediction, which already has its
+        // cures applied.
+        const Model &model = modeller.model_prediction[0];
+        inf[0].assign(num_cells * words, 0);
+        dead[0].assign(num_cells * words, 0);
+        for (int y = 1; y <= ::h; y++)
+            for (int x = 1; x <= ::w; x++) {
+                int c = x + stride * y;
+                double p_inf = model.inf_prob[c];
+                double p_dead = 1.0 - model.clean_prob[c] - p_inf;
+                for (int k = 0; k < words; k++) {
+                    uint64_t r[BITS];
+                    random_words(key(num_epochs, c, k), r);
+                    uint64_t a = less_than(r, p_inf);
+                    uint64_t b = less_than(r, p_inf + p_dead);
+                    inf[0][c * words + k] = a;
+                    dead[0][c * words + k] = b & ~a;
+                }
+            }
+        for (int q = 1; q < num_epochs; q++) {
+            inf[q].assign(num_cells * words, 0);
+            dead[q].assign(num_cells * words, 0);
+            for (int y = 1; y <= ::h; y++)
+                for (int x = 1; x <= ::w; x++) {
+                    int c = x + stride * y;
+                    const uint64_t *pi = inf[q - 1].data();
+                    const uint64_t *prev[5] = {
+                        pi + c * words, pi + (c - 1) * words,
+                        pi + (c + 1) * words, pi + (c - stride) * words,
+                        pi + (c + stride) * words};
+                    step(q, c, prev, &dead[q - 1][c * words],
+                         &inf[q][c * words], &dead[q][c * words]);
+                }
+        }
+    }
+
+    // Same contract as Modeller::simulate(): expected gain in clean cells
+    // at the end of the horizon, by padded cell.
+    Improvement simulate(
+            const vector<CureFootprint> &footprints, int worker = 0) {
+        PERF_SCOPE(simulate);
+        assert(worker >= 0 && worker < scratches.size());
+        auto &sc = scratches[worker];
+        sc.init(num_cells, words);
+
+        sc.changed.clear();
+        for (int q = 0; q < num_epochs; q++) {
+            int cured_epoch = sc.next_epoch();
+            sc.cured.clear();
+            for (const auto &f : footprints)
+                f.cured_sets[q].for_each_point([&](int x, int y) {
+                    int c = x + 1 + stride * (y + 1);
+                    if (sc.cured_stamp[c] != cured_epoch) {
+                        sc.cured_stamp[c] = cured_epoch;
+                        sc.cured.push_back(c);
+                    }
+                });
+
+            int update_epoch = sc.next_epoch();
+            sc.to_update.clear();
+            auto add = [&](int c) {
+                if (sc.update_stamp[c] != update_epoch) {
+                    sc.update_stamp[c] = update_epoch;
+                    sc.to_update.push_back(c);
+                }
+            };
+            for (int c : sc.changed) {
+                int x = c % stride;
+                int y = c / stride;
+                add(c);
+                if (x > 1) add(c - 1);
+                if (x < ::w) add(c + 1);
+                if (y > 1) add(c - stride);
+                if (y < ::h) add(c + stride);
+            }
+            for (int c : sc.cured)
+                add(c);
+
+            // Cells that differ from the baseline live in the overlay;
+            // stamps tell which of them belong to the previous epoch.
+            int prev_epoch = sc.overlay_epoch;
+            int next_epoch = sc.next_epoch();
+            auto prev_inf = [&](int c) {
+                return sc.overlay_stamp[c] == prev_epoch
+                    ? &sc.prev_inf[c * words] : &inf[q - 1][c * words];
+            };
+            auto prev_dead = [&](int c) {
+                return sc.overlay_stamp[c] == prev_epoch
+                    ? &sc.prev_dead[c * words] : &dead[q - 1][c * words];
+            };
+
+            sc.next_changed.clear();
+            for (int c : sc.to_update) {
+                uint64_t *ni = &sc.next_inf[c * words];
+                uint64_t *nd = &sc.next_dead[c * words];
+                if (q == 0) {
+                    copy_n(&inf[0][c * words], words, ni);
+                    copy_n(&dead[0][c * words], words, nd);
+                } else {
+                    const uint64_t *pi[5] = {
+                        prev_inf(c), prev_inf(c - 1), prev_inf(c + 1),
+                        prev_inf(c - stride), prev_inf(c + stride)};
+                    const uint64_t *pd = prev_dead(c);
+                    step(q, c, pi, pd, ni, nd);
+                }
+                if (sc.cured_stamp[c] == cured_epoch)
+                    fill_n(ni, words, 0);
+                if (!equal(ni, ni + words, &inf[q][c * words]) ||
+                    !equal(nd, nd + words, &dead[q][c * words])) {
+                    sc.overlay_stamp_next[c] = next_epoch;
+                    sc.next_changed.push_back(c);
+                }
+            }
+            swap(sc.prev_inf, sc.next_inf);
+            swap(sc.prev_dead, sc.next_dead);
+            swap(sc.overlay_stamp, sc.overlay_stamp_next);
+            sc.overlay_epoch = next_epoch;
+            swap(sc.changed, sc.next_changed);
+        }
+
+        // The overlay now holds the last epoch.
+        sort(sc.changed.begin(), sc.changed.end(), [this](int a, int b) {
+            return make_pair(a % stride, a / stride) <
+                   make_pair(b % stride, b / stride);
+        });
+        Improvement improvement;
+        const auto &base_inf = inf.back();
+        const auto &base_dead = dead.back();
+        for (int c : sc.changed) {
+            int diff = 0;
+            for (int k = 0; k < words; k++) {
+                diff += __builtin_popcountll(
+                    ~(sc.prev_inf[c * words + k] | sc.prev_dead[c * words + k]));
+                diff -= __builtin_popcountll(
+                    ~(base_inf[c * words + k] | base_dead[c * words + k]));
+            }
+            double delta = diff / (64.0 * words);
+            if (delta > 1e-3)
+                improvement.emplace_hint(
+                    improvement.end(),
+                    make_pair(c % stride, c / stride), delta);
+        }
+        return improvement;
+    }
+
+private:
+    static const int BITS = 16;
+
+    struct Scratch {
+        vector<int> cured_stamp, update_stamp;
+        vector<int> overlay_stamp, overlay_stamp_next;
+        int epoch, overlay_epoch;
+        vector<int> cured, to_update, changed, next_changed;
+        vector<uint64_t> prev_inf, prev_dead, next_inf, next_dead;
+
+        void init(int num_cells, int words) {
+            if (cured_stamp.empty()) {
+                cured_stamp.assign(num_cells, 0);
+                update_stamp.assign(num_cells, 0);
+                overlay_stamp.assign(num_cells, 0);
+                overlay_stamp_next.assign(num_cells, 0);
+                prev_inf.assign(num_cells * words, 0);
+                prev_dead.assign(num_cells * words, 0);
+                next_inf.assign(num_cells * words, 0);
+                next_dead.assign(num_cells * words, 0);
+                epoch = 0;
+            }
+            overlay_epoch = next_epoch();
+        }
+
+        int next_epoch() {
+            if (epoch == INT_MAX) {
+                fill(cured_stamp.begin(), cured_stamp.end(), 0);
+                fill(update_stamp.begin(), update_stamp.end(), 0);
+                fill(overlay_stamp.begin(), overlay_stamp.end(), 0);
+                fill(overlay_stamp_next.begin(), overlay_stamp_next.end(), 0);
+                epoch = 0;
+            }
+            return ++epoch;
+        }
+    };
+
+    uint64_t key(int q, int c, int k) const {
+        return ((uint64_t)q * num_cells + c) * words + k;
+    }
+
+    // splitmix64 finalizer; products are taken in 128 bits so that nothing
+    // wraps implicitly.
+    static uint64_t mix(uint64_t z) {
+        z = (uint64_t)((unsigned __int128)(z ^ (z >> 30)) *
+                       0xbf58476d1ce4e5b9ULL);
+        z = (uint64_t)((unsigned __int128)(z ^ (z >> 27)) *
+                       0x94d049bb133111ebULL);
+        return z ^ (z >> 31);
+    }
+
+    // BITS random words for one (key, direction) pair, least significant
+    // bit of the per-future random number first.
+    void random_words(uint64_t k, uint64_t *r, int direction = 0) const {
+        uint64_t base = mix(seed ^ mix(k * 4 + direction)) >> 8;
+        for (int i = 0; i < BITS; i++)
+            r[i] = mix(base + i);
+    }
+
+    // Futures whose BITS-bit random number is below p * 2^BITS.
+    static uint64_t less_than(const uint64_t *r, double p) {
+        if (p <= 0.0)
+            return 0;
+        if (p >= 1.0)
+            return ~0ULL;
+        uint32_t threshold = (uint32_t)(p * (1 << BITS));
+        uint64_t lt = 0;
+        for (int i = 0; i < BITS; i++)
+            lt = (threshold >> i & 1) ? (~r[i] | lt) : (~r[i] & lt);
+        return lt;
+    }
+
+    // One epoch for cell c: everything infected dies, then spread and the
+    // background cures of epoch q. Neighbor order in prev_inf is self,
+    // left, right, up, down.
+    void step(int q, int c, const uint64_t *const prev_inf[5],
+              const uint64_t *prev_dead,
+              uint64_t *next_inf, uint64_t *next_dead) const {
+        for (int k = 0; k < words; k++) {
+            uint64_t clean = ~(prev_inf[0][k] | prev_dead[k]);
+            uint64_t caught = 0;
+            for (int d = 0; d < 4; d++) {
+                uint64_t exposed = clean & prev_inf[d + 1][k];
+                if (exposed == 0)
+                    continue;
+                uint64_t r[BITS];
+                random_words(key(q, c, k), r, d);
+                caught |= exposed & less_than(r, spread_prob);
+            }
+            next_inf[k] = med_cured[q][c] ? 0 : caught;
+            next_dead[k] = prev_dead[k] | prev_inf[0][k];
+        }
+    }
+
+    int words;
+    uint64_t seed;
+    double spread_prob;
+    int stride;
+    int num_cells;
+    int num_epochs;
+    // Baseline (no footprint) per epoch, after its cures.
+    vector<vector<uint64_t>> inf, dead;
+    // Cells cured by the predicted medicine at some tick of the epoch.
+    vector<vector<char>> med_cured;
+    vector<Scratch> scratches;
+};
+
+
+// Repeatedly adds the choice (for a free time slot) with the largest
+// marginal gain, where the value of a set of choices is the sum over cells
+// of the best improvement any of them gives. Ties go to the earliest choice.
+//
+// Lazy greedy (CELF): marginal gains only decrease as the plan grows, so
+// the heap holds possibly stale upper bounds, and a choice is re-evaluated
+// only when it comes to the top and one of its cells improved since (found
+// through the cell -> choices index). Choices dominated by an earlier
+// choice for the same slot can never be picked and are dropped upfront.
+//
+// Once deadline has passed, stops after the next pick and returns the
+// partial plan.
 double greedy(const vector<pair<CureFootprint, Improvement>> &choices,
-            vector<pair<int, int>> &sol) {
-    Improvement accum;
-    for (const auto &choice : choices) {
-        const auto &fp = choice.first;
+            vector<pair<int, int>> &sol,
+            chrono::steady_clock::time_point deadline =
+                chrono::steady_clock::time_point::max()) {
+    PERF_SCOPE(greedy);
+    // Improvement keys are padded coordinates.
+    int stride = ::w + 2;
+    int num_cells = stride * (::h + 2);
+    int n = choices.size();
+
+    // Choice -> (cell, value), sorted by cell.
+    vector<int> start(n + 1, 0);
+    vector<pair<int, double>> entries;
+    for (int j = 0; j < n; j++) {
+        for (const auto &kv : choices[j].second)
+            entries.emplace_back(
+                kv.first.first + stride * kv.first.second, kv.second);
+        sort(entries.begin() + start[j], entries.end());
+        start[j + 1] = entries.size();
+    }
+
+    // Cell -> choices containing it, in increasing order.
+    vector<int> cell_start(num_cells + 1, 0);
+    for (const auto &e : entries)
+        cell_start[e.first + 1]++;
+    for (int c = 0; c < num_cells; c++)
+        cell_start[c + 1] += cell_start[c];
+    vector<int> cell_choices(entries.size());
+    {
+        vector<int> pos(cell_start.begin(), cell_start.end() - 1);
+        for (int j = 0; j < n; j++)
+            for (int k = start[j]; k < start[j + 1]; k++)
+                cell_choices[pos[entries[k].first]++] = j;
+    }
+
+    vector<double> accum(num_cells, 0.0);
+    for (int j = 0; j < n; j++) {
+        const auto &fp = choices[j].first;
         if (sol[fp.t] == make_pair(fp.x, fp.y))
-            improvement_merge_with(accum, choice.second);
+            for (int k = start[j]; k < start[j + 1]; k++)
+                accum[entries[k].first] =
+                    max(accum[entries[k].first], entries[k].second);
     }
 
-    while (true) {
-        double best_improvement = improvement_sum(accum);
-        Improvement new_accum;
+    // Value of accum merged with choice j (or accum alone for j = -1),
+    // summed over cells in the order of Improvement keys (by x, then y).
+    // Used to settle near ties exactly like a full rescan would.
+    vector<int> override_of(num_cells, -1);
+    vector<double> override_value(num_cells);
+    auto ordered_sum = [&](int j) {
+        if (j != -1)
+            for (int k = start[j]; k < start[j + 1]; k++) {
+                int c = entries[k].first;
+                override_of[c] = j;
+                override_value[c] = max(accum[c], entries[k].second);
+            }
+        double result = 0.0;
+        for (int x = 0; x < stride; x++)
+            for (int c = x; c < num_cells; c += stride)
+                result += override_of[c] == j && j != -1
+                    ? override_value[c] : accum[c];
+        return result;
+    };
+
+    auto covers = [&](int i, int j) {
+        // Whether choice i gives at least as much as j in every cell of j.
+        int a = start[i];
+        for (int k = start[j]; k < start[j + 1]; k++) {
+            while (a < start[i + 1] && entries[a].first < entries[k].first)
+                a++;
+            if (a == start[i + 1] || entries[a].first != entries[k].first ||
+                entries[a].second < entries[k].second)
+                return false;
+        }
+        return true;
+    };
 
-        int best_t = -1;
-        int best_x;
-        int best_y;
+    auto gain = [&](int j) {
+        double result = 0.0;
+        for (int k = start[j]; k < start[j + 1]; k++)
+            result += max(0.0, entries[k].second - accum[entries[k].first]);
+        return result;
+    };
+
+    vector<bool> stale(n, false);
+    // (gain bound, -index)
+    priority_queue<pair<double, int>> heap;
+    for (int j = 0; j < n; j++) {
+        const auto &fp = choices[j].first;
+        if (sol[fp.t].first != -1 || start[j] == start[j + 1])
+            continue;
+
+        int rarest = entries[start[j]].first;
+        for (int k = start[j]; k < start[j + 1]; k++) {
+            int c = entries[k].first;
+            if (cell_start[c + 1] - cell_start[c] <
+                cell_start[rarest + 1] - cell_start[rarest])
+                rarest = c;
+        }
+        bool dominated = false;
+        for (int k = cell_start[rarest]; k < cell_start[rarest + 1]; k++) {
+            int i = cell_choices[k];
+            if (i >= j)
+                break;
+            if (choices[i].first.t == fp.t && covers(i, j)) {
+                dominated = true;
+                break;
+            }
+        }
+        if (dominated)
+            continue;
 
-        for (const auto &choice : choices) {
-            const auto &fp = choice.first;
-            const auto &extra_imp = choice.second;
+        double g = gain(j);
+        if (g > 0.0)
+            heap.emplace(g, -j);
+    }
 
-            if (sol[fp.t].first != -1)
+    double current = ordered_sum(-1);
+    bool picked = false;
+    while (!picked || chrono::steady_clock::now() < deadline) {
+        // Pop until the best bound is fresh, then take everything that is
+        // within rounding of it as well.
+        vector<pair<double, int>> ties;
+        while (!heap.empty()) {
+            double bound = heap.top().first;
+            int j = -heap.top().second;
+            if (!ties.empty() &&
+                bound < ties[0].first - 1e-9 * (current + ties[0].first))
+                break;
+            heap.pop();
+            if (sol[choices[j].first.t].first != -1)
                 continue;
+            if (stale[j]) {
+                stale[j] = false;
+                double g = gain(j);
+                if (g > 0.0)
+                    heap.emplace(g, -j);
+                continue;
+            }
+            ties.emplace_back(bound, j);
+        }
+        if (ties.empty())
+            break;
 
-            Improvement tmp_imp = accum;
-            improvement_merge_with(tmp_imp, extra_imp);
-            double new_sum = improvement_sum(tmp_imp);
-            if (new_sum > best_improvement) {
-                best_improvement = new_sum;
-                best_t = fp.t;
-                best_x = fp.x;
-                best_y = fp.y;
-
-                new_accum = tmp_imp;
+        sort(ties.begin(), ties.end(),
+            [](const pair<double, int> &a, const pair<double, int> &b) {
+                return a.second < b.second;
+            });
+        int best = -1;
+        double best_sum = current;
+        for (const auto &tie : ties) {
+            double new_sum = ordered_sum(tie.second);
+            if (new_sum > best_sum) {
+                best_sum = new_sum;
+                best = tie.second;
             }
         }
-        if (best_t == -1)
+        if (best == -1)
             break;
-        sol[best_t] = {best_x, best_y};
-        debug3(best_t, best_x, best_y);
-        accum = new_accum;
+        for (const auto &tie : ties)
+            if (tie.second != best)
+                heap.emplace(tie.first, -tie.second);
+
+        const auto &fp = choices[best].first;
+        sol[fp.t] = {fp.x, fp.y};
+        picked = true;
+        int best_t = fp.t;
+        int best_x = fp.x;
+        int best_y = fp.y;
+        trace3(best_t, best_x, best_y);
+        current = best_sum;
+
+        for (int k = start[best]; k < start[best + 1]; k++) {
+            int c = entries[k].first;
+            if (entries[k].second > accum[c]) {
+                accum[c] = entries[k].second;
+                for (int q = cell_start[c]; q < cell_start[c + 1]; q++)
+                    stale[cell_choices[q]] = true;
+            }
+        }
     }
-    return improvement_sum(accum);
+    return current;
 }
 
-bool try_improve(const vector<pair<CureFootprint, Improvement>> &choices,
-                 vector<pair<int, int>> &sol) {
-    double base_score = greedy(choices, sol);
-    auto sol2 = sol;
-    static default_random_engine gen;
-    for (auto &p : sol2) {
-        if (bernoulli_distribution(0.5)(gen))
-            p = {-1, -1};
-    }
-    double new_score = greedy(choices, sol2);
-    debug2(new_score, base_score);
-    if (new_score > base_score) {
-        cerr << string(60, '*') << endl;
-        sol = sol2;
-        return true;
+// Local search on top of greedy(): hill climbing with restarts, one
+// restart loop per worker until the deadline. Moves re-pick the best drop
+// for one tick, swap the drops of two ticks or move a drop to another
+// tick; a drop that changes tick becomes the choice at the new tick
+// nearest to it. The objective is the same as greedy()'s (per-cell max
+// over chosen improvements), kept up to date per move through a dense
+// value row per tick.
+class PlanSearch {
+public:
+    PlanSearch(const vector<pair<CureFootprint, Improvement>> &choices,
+               int num_ticks)
+        : choices(choices), num_ticks(num_ticks),
+          stride(::w + 2), num_cells(stride * (::h + 2)),
+          start(choices.size() + 1, 0), at_tick(num_ticks) {
+        for (int j = 0; j < choices.size(); j++) {
+            for (const auto &kv : choices[j].second)
+                entries.emplace_back(
+                    kv.first.first + stride * kv.first.second, kv.second);
+            start[j + 1] = entries.size();
+            at_tick[choices[j].first.t].push_back(j);
+        }
+    }
+
+    // Returns the objective of sol and replaces sol if a better plan turns
+    // up before the deadline.
+    double improve(vector<pair<int, int>> &sol, WorkerPool &pool,
+                   chrono::steady_clock::time_point deadline) {
+        vector<int> initial(num_ticks, -1);
+        for (int t = 0; t < num_ticks; t++)
+            for (int j : at_tick[t])
+                if (sol[t] == make_pair(choices[j].first.x, choices[j].first.y))
+                    initial[t] = j;
+
+        vector<State> results(pool.size());
+        vector<int> restarts(pool.size(), 0);
+        pool.parallel_for(pool.size(), [&](int i, int) {
+            mt19937 rng(i + 1);
+            State st(*this);
+            for (int t = 0; t < num_ticks; t++)
+                set_slot(st, t, initial[t]);
+            results[i] = st;
+            while (chrono::steady_clock::now() < deadline) {
+                if (i != 0 || restarts[i] != 0)
+                    perturb(st, rng);
+                climb(st, rng, deadline);
+                if (st.score > results[i].score)
+                    results[i] = st;
+                restarts[i]++;
+                st = results[i];
+            }
+        });
+
+        State base(*this);
+        for (int t = 0; t < num_ticks; t++)
+            set_slot(base, t, initial[t]);
+        double base_score = base.exact_score();
+        double best_score = base_score;
+        const State *best = nullptr;
+        for (const auto &r : results) {
+            double score = r.exact_score();
+            if (score > best_score + 1e-9 * (best_score + 1.0)) {
+                best_score = score;
+                best = &r;
+            }
+        }
+        int num_restarts = accumulate(restarts.begin(), restarts.end(), 0);
+        debug3(num_restarts, base_score, best_score);
+        if (best != nullptr)
+            for (int t = 0; t < num_ticks; t++) {
+                int j = best->slot[t];
+                sol[t] = j == -1 ? make_pair(-1, -1)
+                    : make_pair(choices[j].first.x, choices[j].first.y);
+            }
+        return best_score;
+    }
+
+private:
+    struct State {
+        vector<int> slot;
+        // value[t][c]: what the drop at tick t gives in cell c.
+        vector<vector<double>> value;
+        vector<double> best;
+        double score;
+
+        State() : score(0.0) {}
+
+        explicit State(const PlanSearch &search)
+            : slot(search.num_ticks, -1),
+              value(search.num_ticks, vector<double>(search.num_cells, 0.0)),
+              best(search.num_cells, 0.0), score(0.0) {}
+
+        double exact_score() const {
+            return accumulate(best.begin(), best.end(), 0.0);
+        }
+    };
+
+    void set_slot(State &st, int t, int j) const {
+        int old = st.slot[t];
+        if (old == j)
+            return;
+        st.slot[t] = j;
+        if (old != -1)
+            for (int k = start[old]; k < start[old + 1]; k++)
+                st.value[t][entries[k].first] = 0.0;
+        if (j != -1)
+            for (int k = start[j]; k < start[j + 1]; k++)
+                st.value[t][entries[k].first] = entries[k].second;
+        auto rescan = [&](int c) {
+            double b = 0.0;
+            for (int q = 0; q < num_ticks; q++)
+                b = max(b, st.value[q][c]);
+            st.score += b - st.best[c];
+            st.best[c] = b;
+        };
+        if (old != -1)
+            for (int k = start[old]; k < start[old + 1]; k++)
+                rescan(entries[k].first);
+        if (j != -1)
+            for (int k = start[j]; k < start[j + 1]; k++)
+                rescan(entries[k].first);
+    }
+
+    // Best choice for the empty tick t, or -1 if nothing helps.
+    int best_for(const State &st, int t) const {
+        assert(st.slot[t] == -1);
+        int result = -1;
+        double result_gain = 0.0;
+        for (int j : at_tick[t]) {
+            double gain = 0.0;
+            for (int k = start[j]; k < start[j + 1]; k++)
+                gain += max(0.0, entries[k].second - st.best[entries[k].first]);
+            if (gain > result_gain) {
+                result_gain = gain;
+                result = j;
+            }
+        }
+        return result;
+    }
+
+    // Choice at tick t closest to where choice j drops, or -1.
+    int nearest(int t, int j) const {
+        if (j == -1)
+            return -1;
+        int result = -1;
+        int result_d = INT_MAX;
+        for (int i : at_tick[t]) {
+            int d = abs(choices[i].first.x - choices[j].first.x) +
+                    abs(choices[i].first.y - choices[j].first.y);
+            if (d < result_d) {
+                result_d = d;
+                result = i;
+            }
+        }
+        return result;
     }
-    return false;
+
+    void refill(State &st, vector<int> ticks) const {
+        for (int t : ticks)
+            if (st.slot[t] == -1)
+                set_slot(st, t, best_for(st, t));
+    }
+
+    void perturb(State &st, mt19937 &rng) const {
+        vector<int> emptied;
+        for (int t = 0; t < num_ticks; t++)
+            if (st.slot[t] != -1 && bernoulli_distribution(0.3)(rng)) {
+                set_slot(st, t, -1);
+                emptied.push_back(t);
+            }
+        shuffle(emptied.begin(), emptied.end(), rng);
+        refill(st, emptied);
+    }
+
+    // Applies random moves, keeping those that improve the objective,
+    // until a run of moves in a row fails.
+    void climb(State &st, mt19937 &rng,
+               chrono::steady_clock::time_point deadline) const {
+        uniform_int_distribution<int> tick(0, num_ticks - 1);
+        uniform_int_distribution<int> kind(0, 2);
+        vector<pair<int, int>> undo;
+        for (int failures = 0; failures < 4 * num_ticks; failures++) {
+            if (chrono::steady_clock::now() >= deadline)
+                return;
+            double before = st.score;
+            undo.clear();
+            auto change = [&](int t, int j) {
+                undo.emplace_back(t, st.slot[t]);
+                set_slot(st, t, j);
+            };
+            int a = tick(rng);
+            int b = tick(rng);
+            switch (kind(rng)) {
+                case 0:  // re-pick a
+                    change(a, -1);
+                    change(a, best_for(st, a));
+                    break;
+                case 1: {  // swap a and b
+                    int ja = st.slot[a];
+                    int jb = st.slot[b];
+                    change(a, nearest(a, jb));
+                    change(b, nearest(b, ja));
+                    break;
+                }
+                case 2: {  // move a to b
+                    int ja = st.slot[a];
+                    change(b, nearest(b, ja));
+                    if (a != b) {
+                        change(a, -1);
+                        change(a, best_for(st, a));
+                    }
+                    break;
+                }
+            }
+            if (st.score > before + 1e-9 * (before + 1.0)) {
+                failures = -1;
+            } else {
+                for (int k = undo.size() - 1; k >= 0; k--)
+                    set_slot(st, undo[k].first, undo[k].second);
+            }
+        }
+    }
+
+    const vector<pair<CureFootprint, Improvement>> &choices;
+    int num_ticks;
+    int stride;
+    int num_cells;
+    // Choice -> (padded cell, value).
+    vector<int> start;
+    vector<pair<int, double>> entries;
+    vector<vector<int>> at_tick;
+};
+
+// Infected mass within the footprint window of every candidate drop
+// (t, x, y), indexed x + w * (y + h * t). Used to order the work when
+// planning under a time budget.
+vector<double> plan_promise(const Modeller &modeller, int time_to_observation) {
+    vector<double> promise(time_to_observation * w * h);
+    vector<double> sums((w + 1) * (h + 1));
+    int epoch = -1;
+    for (int t = 0; t < time_to_observation; t++) {
+        int e = count(modeller.phases.begin(), modeller.phases.begin() + t, true);
+        if (e != epoch) {
+            // sums[x + (w + 1) * y] is the mass of [0, x) x [0, y).
+            epoch = e;
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                    sums[x + 1 + (w + 1) * (y + 1)] =
+                        modeller.inf_at(e, x + 1, y + 1) +
+                        sums[x + (w + 1) * (y + 1)] +
+                        sums[x + 1 + (w + 1) * y] -
+                        sums[x + (w + 1) * y];
+        }
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                int x1 = max(x - horizon, 0), x2 = min(x + horizon + 1, w);
+                int y1 = max(y - horizon, 0), y2 = min(y + horizon + 1, h);
+                promise[x + w * (y + h * t)] =
+                    sums[x2 + (w + 1) * y2] - sums[x1 + (w + 1) * y2] -
+                    sums[x2 + (w + 1) * y1] + sums[x1 + (w + 1) * y1];
+            }
+    }
+    return promise;
 }
 
+
 class ViralInfection {
+    unique_ptr<Modeller> prev_modeller;
+    int prev_start;
+
 public:
+    ViralInfection() : prev_start(0) {}
 
+    // drop_med, if given, is the same medicine as med in the form of a
+    // DropField, and is used instead of it to build the Modeller.
     vector<pair<int, int>> make_plan(
-        vector<vector<double>> med, Model model, int time_to_observation, int start_iteration) {
+        MedField med, Model model, int time_to_observation, int start_iteration,
+        const DropField *drop_med = nullptr) {
+        auto plan_start = chrono::steady_clock::now();
 
         vector<bool> phases;
 
@@ -589,129 +2560,274 @@ public:
                              (start_iteration + i + 1) % ::kill_time == 0);
         debug(phases);
 
-        Modeller modeller(med, model, phases);
-
-        vector<pair<CureFootprint, Improvement>> choices;
+        auto &pool = worker_pool();
+        bool incremental = parameters.at("incremental") != 0;
+        bool compact = parameters.at("compact_predictions") != 0;
+        unique_ptr<Modeller> current;
+        {
+            PERF_SCOPE(modeller_build);
+            if (drop_med != nullptr)
+                current.reset(new Modeller(
+                    *drop_med, model, phases, pool.size()));
+            else
+                current.reset(new Modeller(
+                    med, model, phases, pool.size(),
+                    incremental ? prev_modeller.get() : nullptr,
+                    start_iteration - prev_start, compact));
+        }
+        const Modeller &modeller = *current;
+
+        double frontier_speed =
+            sqrt(::med_strength) * ::kill_time / min(::w, ::h);
+        double frontier_discount_factor =
+            parameters.at("frontier_discount_factor");
+
+        // With a budget, candidates are evaluated most promising first and
+        // whatever is left when a stage's share of it runs out is skipped:
+        // footprints get up to 40%, simulation up to 85%, and the rest is
+        // for the frontier and greedy. Without a budget everything is
+        // evaluated, so the order doesn't matter.
+        double budget_ms = parameters.at("plan_budget_ms");
+        chrono::steady_clock::time_point deadline;
+        auto set_deadline = [&](double share) {
+            deadline = plan_start + chrono::duration_cast<
+                chrono::steady_clock::duration>(
+                    chrono::duration<double, milli>(budget_ms * share));
+        };
+        auto out_of_time = [&]() {
+            return budget_ms > 0 && chrono::steady_clock::now() >= deadline;
+        };
+
+        // Candidate (t, x, y) is number x + w * (y + h * t). Footprints
+        // only contain active cells within horizon of the drop, so drops farther
+        // than that from every predicted active box are not candidates.
+        int x1 = INT_MAX, y1 = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+        for (int e = 0; e < modeller.num_epochs(); e++) {
+            int num_active, ax1, ay1, ax2, ay2;
+            modeller.active_box(e, num_active, ax1, ay1, ax2, ay2);
+            if (num_active > 0) {
+                x1 = min(x1, ax1 - 1 - horizon);
+                y1 = min(y1, ay1 - 1 - horizon);
+                x2 = max(x2, ax2 - 1 + horizon);
+                y2 = max(y2, ay2 - 1 + horizon);
+            }
+        }
+        vector<double> promise;
+        vector<int> order;
+        for (int t = 0; t < time_to_observation; t++)
+            for (int y = max(y1, 0); y <= min(y2, h - 1); y++)
+                for (int x = max(x1, 0); x <= min(x2, w - 1); x++)
+                    order.push_back(x + w * (y + h * t));
+        PERF_COUNT(candidates, order.size());
+        if (budget_ms > 0) {
+            promise = plan_promise(modeller, time_to_observation);
+            stable_sort(order.begin(), order.end(),
+                [&promise](int a, int b) {
+                    return promise[a] > promise[b];
+                });
+        }
 
+        // Even when an earlier stage used up a share, the first
+        // min_items of a stage are done, so that there is always a plan.
+        int min_items = time_to_observation;
+
+        set_deadline(0.4);
+        // footprints[k] is for candidate order[k]. Only non-empty ones are
+        // kept; the rest stay default constructed, which holds no cell sets.
+        vector<CureFootprint> footprints(order.size());
+        vector<char> footprinted(order.size(), 0);
+        pool.parallel_for(order.size(), [&](int k, int) {
+            if (k >= min_items && out_of_time())
+                return;
+            int i = order[k];
+            auto f = modeller.make_cure_footprint(
+                i % w, i / w % h, i / (w * h));
+            if (!f.empty())
+                footprints[k] = move(f);
+            footprinted[k] = 1;
+        });
+
+        // Per tick and in candidate order, which the frontier depends on.
+        vector<int> made;
+        for (int k = 0; k < order.size(); k++)
+            if (!footprints[k].empty())
+                made.push_back(k);
+        sort(made.begin(), made.end(),
+            [&order](int a, int b) {
+                return order[a] < order[b];
+            });
+        vector<vector<CureFootprint>> cure_footprints(time_to_observation);
+        for (int k : made)
+            cure_footprints[order[k] / (w * h)].push_back(move(footprints[k]));
+        footprints.clear();
+
+        vector<vector<CureFootprint>> frontiers(time_to_observation);
         for (int t = 0; t < time_to_observation; t++) {
-            vector<CureFootprint> cure_footprints;
-            for (int y = 0; y < h; y++) {
-                for (int x = 0; x < w; x++) {
-                    auto cfp = modeller.make_cure_footprint(x, y, t);
-                    if (!cfp.empty())
-                        cure_footprints.push_back(cfp);
-                }
-            }
-            debug2(t, cure_footprints.size());
+            debug2(t, cure_footprints[t].size());
+            PERF_COUNT(footprints, cure_footprints[t].size());
 
-            sort(cure_footprints.begin(), cure_footprints.end(),
-                [](const CureFootprint &a, const CureFootprint &b) {
-                    return a.size() > b.size();
+            frontiers[t] = pareto_frontier(cure_footprints[t]);
+            debug(frontiers[t].size());
+            PERF_COUNT(frontier, frontiers[t].size());
+        }
+        cure_footprints.clear();
+
+        vector<pair<int, int>> to_simulate;
+        for (int t = 0; t < time_to_observation; t++)
+            for (int i = 0; i < frontiers[t].size(); i++)
+                to_simulate.emplace_back(t, i);
+        if (budget_ms > 0)
+            stable_sort(to_simulate.begin(), to_simulate.end(),
+                [&](const pair<int, int> &a, const pair<int, int> &b) {
+                    const auto &fa = frontiers[a.first][a.second];
+                    const auto &fb = frontiers[b.first][b.second];
+                    return promise[fa.x + w * (fa.y + h * a.first)] >
+                           promise[fb.x + w * (fb.y + h * b.first)];
                 });
 
-            // TODO: among equivalent items, pick ones that go ahead of the
-            // frontier as much as possible.
-            vector<CureFootprint> frontier_cure_footprints;
-            for (const auto &cfp : cure_footprints) {
-                bool to_add = true;
-                for (const auto &d : frontier_cure_footprints) {
-                    if (d.dominates(cfp)) {
-                        to_add = false;
-                        break;
-                    }
-                }
-                if (to_add)
-                    frontier_cure_footprints.push_back(cfp);
-            }
-            debug(frontier_cure_footprints.size());
-
-            double frontier_speed =
-                sqrt(::med_strength) * ::kill_time / min(::w, ::h);
-
-            for (const auto &fp : frontier_cure_footprints) {
-                auto imp = modeller.simulate({fp});
-                for (auto &kv : imp) {
-                    int x = kv.first.first;
-                    int y = kv.first.second;
-                    double d = x + y;
-                    // if (::w < 2 * ::h)
-                    //     d = 1.4 * y;
-                    // if (::h < 2 * ::w)
-                    //     d = 1.4 * x;
-                    kv.second *= exp(-d * parameters.at("frontier_discount_factor") / frontier_speed);
-                }
-                choices.emplace_back(fp, imp);
-            }
-            // #for (auto fp : frontier_cure_footprints)
-            // debug2(frontier_cure_footprints.front().cured_sets[0].points,
-            //        frontier_cure_footprints.front().cured_sets[1].points);
-            // debug(modeller.simulate({frontier_cure_footprints.front()}));
-            // debug(modeller.simulate({frontier_cure_footprints.back()}));
+        // Sampled simulation instead of the Distr one, see MonteCarlo.
+        unique_ptr<MonteCarlo> monte_carlo;
+        int monte_carlo_words = parameters.at("monte_carlo_words");
+        if (monte_carlo_words > 0)
+            monte_carlo.reset(new MonteCarlo(
+                modeller, monte_carlo_words, start_iteration, pool.size()));
+
+        vector<vector<Improvement>> imps(time_to_observation);
+        vector<vector<char>> simulated(time_to_observation);
+        for (int t = 0; t < time_to_observation; t++) {
+            imps[t].resize(frontiers[t].size());
+            simulated[t].assign(frontiers[t].size(), 0);
         }
+        set_deadline(0.85);
+        pool.parallel_for(to_simulate.size(), [&](int k, int worker) {
+            if (k >= min_items && out_of_time())
+                return;
+            int t = to_simulate[k].first;
+            int i = to_simulate[k].second;
+            auto &imp = imps[t][i];
+            imp = monte_carlo
+                ? monte_carlo->simulate({frontiers[t][i]}, worker)
+                : modeller.simulate({frontiers[t][i]}, worker);
+            for (auto &kv : imp) {
+                int x = kv.first.first;
+                int y = kv.first.second;
+                double d = x + y;
+                // if (::w < 2 * ::h)
+                //     d = 1.4 * y;
+                // if (::h < 2 * ::w)
+                //     d = 1.4 * x;
+                kv.second *= exp(-d * frontier_discount_factor / frontier_speed);
+            }
+            simulated[t][i] = 1;
+        });
+
+        vector<pair<CureFootprint, Improvement>> choices;
+        for (int t = 0; t < time_to_observation; t++)
+            for (int i = 0; i < frontiers[t].size(); i++)
+                if (simulated[t][i])
+                    choices.emplace_back(frontiers[t][i], imps[t][i]);
 
         debug(choices.size());
+        PERF_COUNT(choices, choices.size());
 
         // vector<bool> free_slots(time_to_observation, true);
         vector<pair<int, int>> sol(time_to_observation, {-1, -1});
 
-        double sol_score = greedy(choices, sol);
-        // for (int i = 0; i < 100; i++)
-        //     try_improve(choices, sol);
+        set_deadline(1.0);
+        double sol_score = budget_ms > 0
+            ? greedy(choices, sol, deadline)
+            : greedy(choices, sol);
+        double improve_budget_ms = parameters.at("improve_budget_ms");
+        if (improve_budget_ms > 0 && !choices.empty()) {
+            auto improve_deadline = chrono::steady_clock::now() +
+                chrono::duration_cast<chrono::steady_clock::duration>(
+                    chrono::duration<double, milli>(improve_budget_ms));
+            // Never past the plan budget.
+            if (budget_ms > 0)
+                improve_deadline = min(improve_deadline, deadline);
+            sol_score = PlanSearch(choices, time_to_observation).improve(
+                sol, pool, improve_deadline);
+        }
 
         debug(sol);
         debug(sol_score);
 
+        double plan_ms = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - plan_start).count();
+        int num_footprinted = count(footprinted.begin(), footprinted.end(), 1);
+        info3(budget_ms, plan_ms, order.size());
+        info3(num_footprinted, to_simulate.size(), choices.size());
+        if (budget_ms > 0 && plan_ms > budget_ms) {
+            LOG(LOG_INFO, "## plan over budget: plan_ms = " << plan_ms
+                << ", budget_ms = " << budget_ms);
+            PERF_COUNT(overruns, 1);
+        }
+
+        // Footprints are not kept: the next round starts after the observe
+        // tick, so it never plans a tick this one did.
+        current->scratches.clear();
+        prev_modeller = move(current);
+        prev_start = start_iteration;
+
+        PERF_END_ROUND();
         return sol;
     }
 
     int runSim(vector<string> slide,
                int med_strength, int kill_time, double spread_prob) {
+        PERF_REPORT_ON_EXIT();
         ::h = slide.size();
         ::w = slide[0].size();
         ::med_strength = med_strength;
         ::kill_time = kill_time;
         ::spread_prob = spread_prob;
 
-        cerr << "## "; debug(w);
-        cerr << "## "; debug(h);
+        info(w);
+        info(h);
 
-        cerr << "## "; debug(med_strength);
-        cerr << "## "; debug(kill_time);
-        cerr << "## "; debug(spread_prob);
+        info(med_strength);
+        info(kill_time);
+        info(spread_prob);
 
-        double infected_density = 0;
-        double dead_density = 0;
-        for (const auto &row : slide) {
-            for (char c : row) {
-                if (c == 'V') infected_density++;
-                if (c == 'X') dead_density++;
-            }
-        }
-        infected_density /= w * h;
-        dead_density /= w * h;
-        cerr << "## "; debug(infected_density);
-        cerr << "## "; debug(dead_density);
+        Observation obs = Observation::from_slide(slide);
+        double infected_density = (double)obs.num_infected / (w * h);
+        double dead_density = (double)obs.num_dead / (w * h);
+        info(infected_density);
+        info(dead_density);
 
         double tto = parameters.at("tto");
-        cerr << "## "; debug(tto);
+        info(tto);
+        int tto_kill_time_1 = parameters.at("tto_kill_time_1");
+        int tto_double_max_kill_time = parameters.at("tto_double_max_kill_time");
+        double tto_double_max_spread = parameters.at("tto_double_max_spread");
 
         ///////////////
         // return 0;
         ///////////////
 
-        ::diffusion = Diffusion(w, h, med_strength);
-
-        vector<vector<double>> med(h, vector<double>(w, 0.0));
-
-        auto model = slide_to_model(slide);
-        show_model(cerr, model);
-        cerr << endl;
+        ::horizon = parameters.at("horizon");
+        ::footprint_kernel = make_footprint_kernel(horizon, w, h, med_strength);
+
+        // The dense field stays the reference: the model checked against
+        // every observation must match the tester exactly.
+        MedField med(w, h);
+        MedField new_med(w, h);
+        bool analytic_med = parameters.at("analytic_med") != 0;
+        DropField drop_med(w, h);
+
+        auto model = slide_to_model(obs);
+        if (log_enabled(LOG_DEBUG)) {
+            ostringstream out;
+            show_model(out, model);
+            out << '\n';
+            logger().write(out.str());
+        }
 
         int iteration = 0;
         while (true) {
             int time_to_observation = kill_time;
             if (kill_time == 1)
-                 time_to_observation = 3;
+                 time_to_observation = tto_kill_time_1;
             //if (kill_time == 2)
             //    time_to_observation = 4;
             // if (kill_time == 3)
@@ -719,13 +2835,15 @@ public:
 
             //time_to_observation = kill_time * parameters.at("tto");
 
-            if (kill_time >= 2 && kill_time <= 6 && spread_prob < 4.4)
+            if (kill_time >= 2 && kill_time <= tto_double_max_kill_time &&
+                spread_prob < tto_double_max_spread)
                 time_to_observation = 2 * kill_time;
 
             if (iteration)
                 time_to_observation--;
 
-            auto plan = make_plan(med, model, time_to_observation, iteration);
+            auto plan = make_plan(med, model, time_to_observation, iteration,
+                                  analytic_med ? &drop_med : nullptr);
             assert(plan.size() == time_to_observation);
             for (int q = 0; q < time_to_observation; q++) {
 
@@ -746,7 +2864,9 @@ public:
                     int y = pt.second;
                     Research::addMed(x, y);
                     // this_thread::sleep_for(std::chrono::seconds(3));
-                    med[y][x] += med_strength;
+                    med.at(x, y) += med_strength;
+                    if (analytic_med)
+                        drop_med.add(x, y);
                 }
 
                 // cure
@@ -757,20 +2877,16 @@ public:
                     // cerr << "spread during plan execution" << endl;
                     auto new_model = model;
                     update_model(model, new_model);
-                    model = new_model;
+                    swap(model, new_model);
                 }
 
                 // diffuse
-                auto new_med = med;
                 diffusion_step(med, new_med);
-                med = new_med;
-
-                bool has_virus = false;
-                for (int y = 0; y < ::h; y++)
-                    for (int x = 0; x < ::w; x++)
-                        if (model[y + 1][x + 1].inf_prob > 1e-8)
-                            has_virus = true;
-                if (!has_virus) {
+                swap(med, new_med);
+                if (analytic_med)
+                    drop_med.step();
+
+                if (model.num_active == 0) {
                     return 0;
                 }
 
@@ -778,9 +2894,9 @@ public:
             }
 
             // observe and check
-            slide = Research::observe();
+            obs = Research::observe();
             // this_thread::sleep_for(std::chrono::seconds(3));
-            auto reality = slide_to_model(slide);
+            auto reality = slide_to_model(obs);
             check_model(model, reality);
 
             // cerr << "model:" << endl;
@@ -791,12 +2907,7 @@ public:
             // show_model(cerr, reality);
             // cerr << endl;
 
-            bool has_infection = false;
-            for (const auto &row : slide)
-                for (char c : row)
-                    if (c == 'V')
-                        has_infection = true;
-            if (!has_infection) {
+            if (!has_infection(obs)) {
                 break;
             }
 
@@ -812,28 +2923,22 @@ public:
                 // cerr << "spread during observation" << endl;
                 auto new_model = model;
                 update_model(model, new_model);
-                model = new_model;
+                swap(model, new_model);
             }
 
             // diffuse
-            auto new_med = med;
             diffusion_step(med, new_med);
-            med = new_med;
-
-            bool has_virus = false;
-            for (int y = 0; y < ::h; y++)
-                for (int x = 0; x < ::w; x++)
-                    if (model[y + 1][x + 1].inf_prob > 1e-8)
-                        has_virus = true;
-            if (!has_virus) {
+            swap(med, new_med);
+            if (analytic_med)
+                drop_med.step();
+
+            if (model.num_active == 0) {
                 return 0;
             }
 
             iteration++;
         }
 
-        cerr.flush();
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
         return 0;
     }
 };
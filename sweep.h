@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+#include <chrono>
+#include <functional>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+// Runs every (setting, seed) pair as its own forked child, up to max_jobs
+// at a time. The planner keeps its state in globals, so a fresh process
+// per run is the simplest way to keep runs isolated and the results
+// independent of scheduling. The caller must not have started any threads
+// (forking copies only the calling one).
+struct SweepSetting {
+    std::vector<std::pair<std::string, double>> params;
+};
+
+struct SweepRun {
+    int setting;
+    int64_t seed;
+    bool ok;
+    double score;
+    double seconds;
+};
+
+// run(setting, seed) is called in the child and returns the score.
+inline std::vector<SweepRun> run_sweep(
+        const std::vector<SweepSetting> &settings,
+        int64_t first_seed, int64_t last_seed, int max_jobs,
+        const std::function<double(const SweepSetting &, int64_t)> &run) {
+    assert(max_jobs >= 1);
+    assert(first_seed <= last_seed);
+
+    // Seed-major, so that all settings progress at the same pace.
+    std::vector<SweepRun> runs;
+    for (int64_t seed = first_seed; seed <= last_seed; seed++)
+        for (int i = 0; i < settings.size(); i++)
+            runs.push_back({i, seed, false, 0.0, 0.0});
+
+    // Child pid -> (run index, read end of its result pipe).
+    std::map<pid_t, std::pair<int, int>> running;
+    int next = 0;
+    fflush(stdout);
+    fflush(stderr);
+    while (next < runs.size() || !running.empty()) {
+        if (next < runs.size() && running.size() < max_jobs) {
+            int fds[2];
+            int rc = pipe(fds);
+            assert(rc == 0);
+            pid_t pid = fork();
+            assert(pid >= 0);
+            if (pid == 0) {
+                close(fds[0]);
+                auto start = std::chrono::steady_clock::now();
+                double result[2];
+                result[0] = run(settings[runs[next].setting], runs[next].seed);
+                result[1] = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+                // Fits in PIPE_BUF, so the write is all or nothing.
+                ssize_t n = write(fds[1], result, sizeof result);
+                _exit(n == sizeof result ? 0 : 1);
+            }
+            close(fds[1]);
+            running[pid] = std::make_pair(next, fds[0]);
+            next++;
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        assert(pid > 0 && running.count(pid) == 1);
+        SweepRun &r = runs[running[pid].first];
+        int fd = running[pid].second;
+        running.erase(pid);
+
+        double result[2];
+        ssize_t n = read(fd, result, sizeof result);
+        close(fd);
+        r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+               n == sizeof result;
+        if (r.ok) {
+            r.score = result[0];
+            r.seconds = result[1];
+        } else {
+            fprintf(stderr, "setting %d, seed %lld failed (status %d)\n",
+                    r.setting, (long long)r.seed, status);
+        }
+    }
+    return runs;
+}
+
+
+// Mean over successful runs of one setting, with the half-width of the
+// normal-approximation 95% confidence interval. Scores vary much more
+// between seeds than between settings, so the difference from a base
+// setting is also given, paired by seed (over seeds where both ran).
+struct SweepSummary {
+    int runs;
+    int failed;
+    double mean;
+    double ci95;
+    double delta;
+    double delta_ci95;
+    double seconds_per_run;
+};
+
+// Mean of xs and the half-width of its 95% confidence interval.
+inline std::pair<double, double> mean_and_ci95(const std::vector<double> &xs) {
+    if (xs.empty())
+        return std::make_pair(0.0, 0.0);
+    double sum = 0, sum_sq = 0;
+    for (double x : xs) {
+        sum += x;
+        sum_sq += x * x;
+    }
+    int n = xs.size();
+    double mean = sum / n;
+    double ci95 = 0;
+    if (n > 1) {
+        double var = (sum_sq - n * mean * mean) / (n - 1);
+        ci95 = 1.96 * std::sqrt(std::max(var, 0.0) / n);
+    }
+    return std::make_pair(mean, ci95);
+}
+
+inline SweepSummary summarize_sweep(
+        const std::vector<SweepRun> &runs, int setting, int base = 0) {
+    SweepSummary s = {0, 0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    std::vector<double> scores;
+    std::map<int64_t, double> base_scores;
+    for (const auto &r : runs)
+        if (r.setting == base && r.ok)
+            base_scores[r.seed] = r.score;
+    std::vector<double> deltas;
+    double seconds = 0;
+    for (const auto &r : runs) {
+        if (r.setting != setting)
+            continue;
+        if (!r.ok) {
+            s.failed++;
+            continue;
+        }
+        s.runs++;
+        scores.push_back(r.score);
+        if (base_scores.count(r.seed))
+            deltas.push_back(r.score - base_scores[r.seed]);
+        seconds += r.seconds;
+    }
+    std::tie(s.mean, s.ci95) = mean_and_ci95(scores);
+    std::tie(s.delta, s.delta_ci95) = mean_and_ci95(deltas);
+    if (s.runs > 0)
+        s.seconds_per_run = seconds / s.runs;
+    return s;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cassert>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+
+// Fixed set of threads that run parallel_for() jobs. The calling thread
+// takes part as worker 0, so a pool of size 1 spawns no threads at all.
+// Work is handed out dynamically: whoever is free claims the next index.
+class WorkerPool {
+public:
+    explicit WorkerPool(int num_workers)
+        : job(nullptr), job_size(0), generation(0), running(0),
+          stopping(false) {
+        assert(num_workers >= 1);
+        for (int i = 1; i < num_workers; i++)
+            threads.emplace_back(&WorkerPool::worker_loop, this, i);
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads)
+            t.join();
+    }
+
+    int size() const {
+        return threads.size() + 1;
+    }
+
+    // Calls f(i, worker) for every i in [0, n), where worker is in
+    // [0, size()). Returns when all calls are done. Not reentrant.
+    void parallel_for(int n, const std::function<void(int, int)> &f) {
+        if (threads.empty() || n <= 1) {
+            for (int i = 0; i < n; i++)
+                f(i, 0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &f;
+            job_size = n;
+            next_index = 0;
+            running = threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        run_job(f, n, 0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return running == 0; });
+        job = nullptr;
+    }
+
+private:
+    void run_job(const std::function<void(int, int)> &f, int n, int worker) {
+        while (true) {
+            int i = next_index++;
+            if (i >= n)
+                break;
+            f(i, worker);
+        }
+    }
+
+    void worker_loop(int worker) {
+        int seen_generation = 0;
+        while (true) {
+            const std::function<void(int, int)> *f;
+            int n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] {
+                    return stopping || generation != seen_generation;
+                });
+                if (stopping)
+                    return;
+                seen_generation = generation;
+                f = job;
+                n = job_size;
+            }
+            run_job(*f, n, worker);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running--;
+            }
+            done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const std::function<void(int, int)> *job;
+    int job_size;
+    std::atomic<int> next_index;
+    int generation;
+    int running;
+    bool stopping;
+};